@@ -11,6 +11,9 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif /* HAVE_CONFIG_H */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1		/* fopencookie() */
+#endif /* _GNU_SOURCE */
 #include <stdio.h>
 #include <stdlib.h>
 #include <locale.h>
@@ -22,11 +25,51 @@
 #include <assert.h>
 #include <limits.h>
 #include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef __linux__
+#define HAVE_INOTIFY 1
+#include <sys/inotify.h>
+#endif /* __linux__ */
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif /* HAVE_GETOPT_H */
 #include <stdbool.h>
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+#define HAVE_DECOMPRESS 1
+#ifndef HAVE_PTHREAD
+#define HAVE_PTHREAD 1
+#endif /* !HAVE_PTHREAD */
+#endif /* HAVE_ZLIB || HAVE_LZMA || HAVE_ZSTD */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif /* HAVE_LZMA */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
 #include "regex.h"
+#include "libagrep.h"
+
+/* --serve needs fopencookie() to frame the output of each request. */
+#ifdef __GLIBC__
+#define HAVE_SERVE 1
+#endif /* __GLIBC__ */
 
 #ifdef HAVE_GETTEXT
 #include <libintl.h>
@@ -123,11 +166,61 @@ str_in_mem_region(char *mem, size_t mlen, char *str)
 
 /* Short options. */
 static char const short_options[] =
-"cd:e:hiklnqsvwyBD:E:HI:MS:V0123456789-:";
+"abcd:e:hiklnqrsvwyBD:E:HI:MRS:VZ0123456789-:";
 
 static int show_help;
 static char *program_name;
 
+/* While --serve runs a request, errors in the command line of the
+   request must not take the server down: tre_agrep_exit() returns to
+   the request loop instead of exiting. */
+static int in_request;
+static jmp_buf request_jmp;
+static int request_status;
+
+static void
+tre_agrep_exit(int status)
+{
+  if (in_request)
+    {
+      request_status = status;
+      longjmp(request_jmp, 1);
+    }
+  exit(status);
+}
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (ptr == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  return ptr;
+}
+
+static char *
+path_join(const char *prefix, const char *name)
+{
+  size_t plen, nlen;
+  char *path;
+
+  if (prefix == NULL)
+    return strdup(name);
+  plen = strlen(prefix);
+  nlen = strlen(name);
+  path = malloc(plen + nlen + 2);
+  if (path == NULL)
+    return NULL;
+  memcpy(path, prefix, plen);
+  if (plen == 0 || prefix[plen - 1] != '/')
+    path[plen++] = '/';
+  memcpy(path + plen, name, nlen + 1);
+  return path;
+}
+
 static char *prev_filename = NULL;
 static size_t indent = 0;
 
@@ -135,8 +228,26 @@ static size_t indent = 0;
 /* Long options that have no corresponding short equivalents. */
 enum {
   INDENT_OPTION = CHAR_MAX + 1,
+  BINARY_FILES_OPTION,
+  BUILD_INDEX_OPTION,
+  INDEX_OPTION,
   COLOR_OPTION,
   SHOW_POSITION_OPTION,
+  STATS_OPTION,
+  INCLUDE_OPTION,
+  EXCLUDE_OPTION,
+  EXCLUDE_DIR_OPTION,
+  ONE_FILE_SYSTEM_OPTION,
+  SERVE_OPTION,
+  SERVE_WORKERS_OPTION,
+  FOLLOW_OPTION,
+  FOLLOW_TIMEOUT_OPTION,
+  CHECKPOINT_OPTION,
+  DIRECT_IO_OPTION,
+  OUTPUT_OPTION,
+  RESULT_CACHE_OPTION,
+  RESULT_CACHE_SIZE_OPTION,
+  JOBS_OPTION,
   DEBUG_OPTION
 };
 
@@ -144,31 +255,54 @@ enum {
 static struct option const long_options[] =
 {
   {"best-match", no_argument, NULL, 'B'},
+  {"binary-files", required_argument, NULL, BINARY_FILES_OPTION},
+  {"build-index", required_argument, NULL, BUILD_INDEX_OPTION},
+  {"byte-offset", no_argument, NULL, 'b'},
+  {"checkpoint", required_argument, NULL, CHECKPOINT_OPTION},
   {"color", no_argument, NULL, COLOR_OPTION},
   {"colour", no_argument, NULL, COLOR_OPTION},
   {"count", no_argument, NULL, 'c'},
+  {"decompress", no_argument, NULL, 'Z'},
   {"debug", no_argument, NULL, DEBUG_OPTION},
   {"delete-cost", required_argument, NULL, 'D'},
   {"delimiter", required_argument, NULL, 'd'},
   {"delimiter-after", no_argument, NULL, 'M'},
+  {"direct-io", no_argument, NULL, DIRECT_IO_OPTION},
+  {"dereference-recursive", no_argument, NULL, 'R'},
+  {"exclude", required_argument, NULL, EXCLUDE_OPTION},
+  {"exclude-dir", required_argument, NULL, EXCLUDE_DIR_OPTION},
   {"files-with-matches", no_argument, NULL, 'l'},
+  {"follow", no_argument, NULL, FOLLOW_OPTION},
+  {"follow-timeout", required_argument, NULL, FOLLOW_TIMEOUT_OPTION},
   {"help", no_argument, &show_help, 1},
   {"ignore-case", no_argument, NULL, 'i'},
+  {"include", required_argument, NULL, INCLUDE_OPTION},
   {"indent", required_argument, NULL, INDENT_OPTION},
+  {"index", required_argument, NULL, INDEX_OPTION},
   {"insert-cost", required_argument, NULL, 'I'},
   {"invert-match", no_argument, NULL, 'v'},
+  {"jobs", required_argument, NULL, JOBS_OPTION},
   {"line-number", no_argument, NULL, 'n'},
   {"literal", no_argument, NULL, 'k'},
   {"max-errors", required_argument, NULL, 'E'},
   {"no-filename", no_argument, NULL, 'h'},
   {"nothing", no_argument, NULL, 'y'},
+  {"one-file-system", no_argument, NULL, ONE_FILE_SYSTEM_OPTION},
+  {"output", required_argument, NULL, OUTPUT_OPTION},
   {"quiet", no_argument, NULL, 'q'},
   {"record-number", no_argument, NULL, 'n'},
+  {"recursive", no_argument, NULL, 'r'},
   {"regexp", required_argument, NULL, 'e'},
+  {"result-cache", required_argument, NULL, RESULT_CACHE_OPTION},
+  {"result-cache-size", required_argument, NULL, RESULT_CACHE_SIZE_OPTION},
   {"show-cost", no_argument, NULL, 's'},
+  {"serve", required_argument, NULL, SERVE_OPTION},
+  {"serve-workers", required_argument, NULL, SERVE_WORKERS_OPTION},
   {"show-position", no_argument, NULL, SHOW_POSITION_OPTION},
   {"silent", no_argument, NULL, 'q'},
+  {"stats", optional_argument, NULL, STATS_OPTION},
   {"substitute-cost", required_argument, NULL, 'S'},
+  {"text", no_argument, NULL, 'a'},
   {"version", no_argument, NULL, 'V'},
   {"with-filename", no_argument, NULL, 'H'},
   {"word-regexp", no_argument, NULL, 'w'},
@@ -211,14 +345,61 @@ Approximate matching settings:\n\
 			    digit between 0 and 9)\n\
 \n\
 Miscellaneous:\n\
+  -a, --text		    same as --binary-files=text\n\
+      --binary-files=TYPE   assume that binary files are TYPE;\n\
+                            TYPE is `binary', `text', or `without-match'\n\
   -d, --delimiter=PATTERN   set the record delimiter regular expression\n\
+  -Z, --decompress	    also decompress standard input and other input\n\
+			    that is not a regular file; regular files\n\
+			    compressed with gzip, xz or zstd are always\n\
+			    decompressed\n\
   -v, --invert-match	    select non-matching records\n\
+  -r, --recursive	    search directories recursively; symbolic links\n\
+			    are followed only if they are on the command line\n\
+  -R, --dereference-recursive\n\
+			    likewise, but follow all symbolic links\n\
+      --include=GLOB        with -r, search only files whose base name\n\
+                            matches GLOB\n\
+      --exclude=GLOB        with -r, skip files whose base name matches GLOB\n\
+      --exclude-dir=GLOB    with -r, skip directories whose base name\n\
+                            matches GLOB\n\
+      --one-file-system     with -r, do not descend into directories on\n\
+                            other file systems\n\
+      --jobs=NUM            with -r, search NUM files at a time (default:\n\
+                            one per CPU)\n\
   -V, --version		    print version information and exit\n\
   -y, --nothing		    does nothing (for compatibility with the non-free\n\
 			    agrep program)\n\
+      --build-index=DIR     write a q-gram index of the FILEs to DIR; no\n\
+                            PATTERN is given\n\
+      --index=DIR           use the index in DIR to skip the parts of\n\
+                            unchanged files that cannot match a literal\n\
+                            PATTERN\n\
+      --stats[=FORMAT]      print I/O and matching statistics to standard\n\
+                            error at exit; FORMAT is `text' (default) or\n\
+                            `json'\n\
+      --checkpoint=FILE     search only what was appended to each FILE since\n\
+                            the last run with the same state FILE\n\
+      --result-cache=DIR    remember the records selected in each unchanged\n\
+                            FILE in DIR, and read only those when the same\n\
+                            search is run again\n\
+      --result-cache-size=MB  keep DIR under MB megabytes (default: 256)\n\
+      --direct-io           read files around the page cache, so that a\n\
+                            large search does not evict other data\n\
+      --follow              at the end of each FILE, wait for more data, and\n\
+                            go on across truncation and replacement\n\
+      --follow-timeout=SECS with --follow, search a partial last record\n\
+                            after SECS seconds without new data (default: 1)\n\
+      --serve=SOCKET        run as a server on the Unix socket SOCKET,\n\
+                            keeping compiled patterns between requests\n\
+      --serve-workers=NUM   number of server worker processes (default:\n\
+                            one per CPU)\n\
+      --client=SOCKET       run this command line on the server at SOCKET;\n\
+                            must be the first option\n\
       --help		    display this help and exit\n\
 \n\
 Output control:\n\
+  -b, --byte-offset	    print the byte offset of each record with output\n\
   -B, --best-match	    only output records with least errors\n\
   -c, --count		    only print a count of matching records per FILE\n\
   -h, --no-filename	    suppress the prefixing filename on output\n\
@@ -234,11 +415,14 @@ strings\n\
       --show-position       prefix each output record with start and end\n\
                             position of the first match within the record\n\
       --indent=NUM          Show each filename only once, and show all other\n\
-                            information indented\n"));
+                            information indented\n\
+      --output=FORMAT       output FORMAT is `text' (default), `ndjson' (a\n\
+                            JSON object per record) or `binary'\n"));
       printf("\n");
       printf(_("\
-With no FILE, or when FILE is -, reads standard input.  If less than two\n\
-FILEs are given, -h is assumed.  Exit status is 0 if a match is found, 1 for\n\
+With no FILE, or when FILE is -, reads standard input; with -r and no FILE,\n\
+searches the working directory.  If less than two FILEs are given and -r is\n\
+not used, -h is assumed.  Exit status is 0 if a match is found, 1 for\n\
 no match, and 2 if there were errors.  If -E or -# is not specified, only\n\
 exact matches are selected.\n"));
       printf("\n");
@@ -249,240 +433,663 @@ See tre(7) for a complete description.\n"));
       printf(_("Report bugs to: "));
       printf("%s.\n", PACKAGE_BUGREPORT);
     }
-  exit(status);
+  tre_agrep_exit(status);
 }
 
-static regex_t preg;	  /* Compiled pattern to search for. */
-static regex_t delim;	  /* Compiled record delimiter pattern. */
-
-// Initial size of the buffer
-//
-#define INITIAL_BUF_SIZE 10240
-static char *buf;	   /* Buffer for scanning text. */
-static int buf_size;	   /* Current size of the buffer. */
-static int data_len;	   /* Amount of data in the buffer. */
-static char *record;	   /* Start of current record. */
-static char *next_record;  /* Start of next record. */
-static int record_len;	   /* Length of current record. */
-static int delim_len;      /* Length of delimiter before record. */
-static int next_delim_len; /* Length of delimiter after record. */
+/* The compiled pattern and record delimiter, and the matching
+   parameters. */
+static struct agrep_searcher searcher;
+
+/* Splits the input into records; `reader.record' is the current one. */
+static struct agrep_reader reader;
+
 static int delim_after = 1;/* If true, print the delimiter after the record. */
-static int at_eof;
+static int file_is_binary; /* If true, a NUL byte was seen in this file. */
+static int binary_checked; /* If true, the first block was looked at. */
 static int have_matches;   /* If true, matches have been found. */
 
 static int invert_match;   /* Show only non-matching records. */
 static int print_filename; /* Output filename. */
 static int print_recnum;   /* Output record number. */
+static int print_byte_offset; /* Output byte offset of the record. */
 static int print_cost;	   /* Output match cost. */
 static int count_matches;  /* Count matching records. */
 static int list_files;	   /* List matching files. */
 static int color_option;   /* Highlight matches. */
 static int print_position;  /* Show start and end offsets for matches. */
 
+/* Format of the selected records (--output). */
+enum {
+  OUTPUT_TEXT,		     /* The records, with optional prefixes. */
+  OUTPUT_NDJSON,	     /* One JSON object per record. */
+  OUTPUT_BINARY		     /* Length-prefixed binary frames. */
+};
+static int output_format = OUTPUT_TEXT;
+
+/* How to treat files that contain NUL bytes (--binary-files). */
+enum {
+  BINARY_BINARY,	     /* Report "Binary file matches" and stop. */
+  BINARY_TEXT,		     /* Treat as text. */
+  BINARY_WITHOUT_MATCH	     /* Assume the file does not match. */
+};
+static int binary_files = BINARY_BINARY;
+static int delim_matches_nul; /* NUL is a delimiter, so not binary data. */
+
+static int force_decompress; /* Sniff non-seekable input for compression. */
+
+static int follow_mode;	     /* --follow: wait for more data at end of file. */
+static int follow_timeout = 1000; /* Milliseconds before a partial last
+				     record is searched anyway. */
+
+/* A file followed with --follow.  Each has its own reader, which is
+   copied to `reader' while the file is being searched. */
+struct tre_agrep_follow {
+  const char *name;	     /* Name used in output. */
+  const char *path;	     /* Path to watch, NULL for standard input. */
+  int fd;		     /* -1 while the file does not exist. */
+  int regular;		     /* A regular file: it grows, it does not end. */
+  int done;		     /* The writer closed the pipe. */
+  int reported;		     /* An open error was reported. */
+  dev_t dev;
+  ino_t ino;
+  int binary;		     /* `file_is_binary' for this file, */
+  int binary_checked;	     /* and `binary_checked'. */
+  int flush_partial;	     /* Search the partial last record now. */
+  size_t partial_len;	     /* Length of the partial last record, */
+  unsigned long long partial_since; /* and when it last grew. */
+  struct agrep_reader reader;
+};
+
+static struct tre_agrep_follow *follow_current; /* File being searched. */
+
+static const char *checkpoint_path; /* --checkpoint state file. */
+static int checkpointing;  /* The current file resumes from a checkpoint. */
+
+static const char *build_index_dir; /* Write an index to this directory. */
+static const char *index_dir;	    /* Use the index in this directory. */
+static const char *index_pattern;   /* PATTERN, if it is a literal string. */
+
+static int recursive;	     /* Search directories recursively. */
+static int follow_symlinks;  /* With -r, follow all symbolic links. */
+static int one_file_system;  /* With -r, stay on the starting file system. */
+static int walk_strip_dot;   /* Name files relative to the implicit ".". */
+static int walk_jobs;	     /* --jobs, 0 for one per CPU. */
+
+/* A list of shell patterns given with --include, --exclude or
+   --exclude-dir. */
+struct tre_agrep_globs {
+  char **pats;
+  size_t n;
+};
+
+static struct tre_agrep_globs include_globs;
+static struct tre_agrep_globs exclude_globs;
+static struct tre_agrep_globs exclude_dir_globs;
+
 static int best_match;	     /* Output only best matches. */
 static int best_cost;	     /* Best match cost found so far. */
 static int be_silent;	     /* Never output anything */
-
-static regaparams_t match_params;
+static int quit;	     /* Stop searching, the outcome is known (-q). */
 
 /* The color string used with the --color option.  If set, the
    environment variable GREP_COLOR overrides this default value. */
 static const char *highlight = "01;31";
 
-/* Sets `record' to the next complete record from file `fd', and `record_len'
-   to the length of the record.	 Returns 1 when there are no more records,
-   0 otherwise. */
-static inline int
-tre_agrep_get_next_record(int fd, const char *filename)
+/* Statistics collected for --stats.  All counters are updated through
+   the STATS_* macros below, which test `stats_mode' first, so the
+   instrumentation costs a single predictable branch when it is off. */
+enum {
+  STATS_OFF,
+  STATS_TEXT,
+  STATS_JSON
+};
+
+#define STATS_HIST_BUCKETS 32
+
+struct tre_agrep_stats {
+  unsigned long long bytes_read;      /* Bytes returned by read(). */
+  unsigned long long read_calls;      /* Number of read() calls. */
+  unsigned long long buf_growths;     /* Number of times `buf' was grown. */
+  unsigned long long peak_buf_size;   /* Largest `buf_size' seen. */
+  unsigned long long bytes_moved;     /* Bytes shifted by memmove(). */
+  unsigned long long records;	      /* Records scanned. */
+  unsigned long long matches;	      /* Records selected for output. */
+  unsigned long long regnexec_calls;  /* Delimiter searches. */
+  unsigned long long reganexec_calls; /* Pattern searches. */
+  unsigned long long io_ns;	      /* Time spent in read(). */
+  unsigned long long delim_ns;	      /* Time spent finding delimiters. */
+  unsigned long long match_ns;	      /* Time spent in the matcher. */
+  unsigned long long output_ns;	      /* Time spent writing output. */
+  /* Record lengths, bucket N holds lengths in [2^(N-1), 2^N). */
+  unsigned long long reclen_hist[STATS_HIST_BUCKETS];
+  /* Costs of matching records, the last bucket holds all larger costs. */
+  unsigned long long cost_hist[STATS_HIST_BUCKETS];
+};
+
+struct tre_agrep_file_stats {
+  char *filename;
+  struct tre_agrep_stats stats;
+};
+
+static int stats_mode;		   /* STATS_OFF, STATS_TEXT or STATS_JSON. */
+static struct tre_agrep_stats file_stats;   /* Stats of the current file. */
+static const char *stats_filename; /* Current file, NULL between files. */
+static struct tre_agrep_file_stats *stats_files;
+static size_t stats_nfiles;
+
+#define STATS_ADD(field, n)						\
+  do { if (stats_mode) file_stats.field += (n); } while (0)
+#define STATS_START(t)							\
+  do { if (stats_mode) (t) = stats_now(); } while (0)
+#define STATS_STOP(t, field)						\
+  do { if (stats_mode) file_stats.field += stats_now() - (t); } while (0)
+
+static unsigned long long
+stats_now(void)
 {
-  if (at_eof)
-    return 1;
+  struct timespec ts;
 
-  while (1)
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+stats_record(size_t len)
+{
+  int bucket = 0;
+
+  while (len != 0 && bucket < STATS_HIST_BUCKETS - 1)
+    {
+      len >>= 1;
+      bucket++;
+    }
+  file_stats.records++;
+  file_stats.reclen_hist[bucket]++;
+}
+
+static void
+stats_cost(int cost)
+{
+  if (cost < 0)
+    cost = 0;
+  file_stats.cost_hist[MIN(cost, STATS_HIST_BUCKETS - 1)]++;
+}
+
+static void
+stats_begin_file(const char *filename)
+{
+  memset(&file_stats, 0, sizeof(file_stats));
+  memset(&reader.stats, 0, sizeof(reader.stats));
+  reader.timing = 1;
+  file_stats.peak_buf_size = reader.buf_size;
+  stats_filename = filename;
+}
+
+static void
+stats_end_file(void)
+{
+  struct tre_agrep_file_stats *fs;
+
+  if (stats_filename == NULL)
+    return;
+  file_stats.buf_growths = reader.stats.buf_growths;
+  file_stats.peak_buf_size = MAX(file_stats.peak_buf_size,
+				 (unsigned long long)reader.buf_size);
+  file_stats.bytes_moved = reader.stats.bytes_moved;
+  file_stats.regnexec_calls = reader.stats.delim_calls;
+  file_stats.delim_ns = reader.stats.delim_ns;
+  reader.timing = 0;
+  fs = realloc(stats_files, (stats_nfiles + 1) * sizeof(*stats_files));
+  if (fs == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  stats_files = fs;
+  fs = &stats_files[stats_nfiles++];
+  fs->filename = strdup(stats_filename);
+  fs->stats = file_stats;
+  stats_filename = NULL;
+}
+
+static void
+stats_sum(struct tre_agrep_stats *total, const struct tre_agrep_stats *st)
+{
+  int i;
+
+  total->bytes_read += st->bytes_read;
+  total->read_calls += st->read_calls;
+  total->buf_growths += st->buf_growths;
+  total->peak_buf_size = MAX(total->peak_buf_size, st->peak_buf_size);
+  total->bytes_moved += st->bytes_moved;
+  total->records += st->records;
+  total->matches += st->matches;
+  total->regnexec_calls += st->regnexec_calls;
+  total->reganexec_calls += st->reganexec_calls;
+  total->io_ns += st->io_ns;
+  total->delim_ns += st->delim_ns;
+  total->match_ns += st->match_ns;
+  total->output_ns += st->output_ns;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
     {
-      int errcode;
-      regmatch_t pmatch[1];
+      total->reclen_hist[i] += st->reclen_hist[i];
+      total->cost_hist[i] += st->cost_hist[i];
+    }
+}
+
+static void
+stats_json_string(const char *str)
+{
+  const unsigned char *s;
+
+  fputc('"', stderr);
+  for (s = (const unsigned char *)str; *s != '\0'; s++)
+    {
+      if (*s == '"' || *s == '\\')
+	fprintf(stderr, "\\%c", *s);
+      else if (*s < 0x20)
+	fprintf(stderr, "\\u%04x", *s);
+      else
+	fputc(*s, stderr);
+    }
+  fputc('"', stderr);
+}
+
+static void
+stats_print_hist_json(const char *name, const unsigned long long *hist)
+{
+  int i, last;
+
+  for (last = STATS_HIST_BUCKETS - 1; last > 0 && hist[last] == 0; last--)
+    ;
+  fprintf(stderr, ",\"%s\":[", name);
+  for (i = 0; i <= last; i++)
+    fprintf(stderr, "%s%llu", i ? "," : "", hist[i]);
+  fputc(']', stderr);
+}
+
+static void
+stats_print_json(const struct tre_agrep_stats *st)
+{
+  fprintf(stderr, "\"bytes_read\":%llu,\"read_calls\":%llu,"
+	  "\"buf_growths\":%llu,\"peak_buf_size\":%llu,\"bytes_moved\":%llu,"
+	  "\"records\":%llu,\"matches\":%llu,"
+	  "\"regnexec_calls\":%llu,\"reganexec_calls\":%llu,"
+	  "\"time\":{\"io\":%.9f,\"delim\":%.9f,\"match\":%.9f,"
+	  "\"output\":%.9f}",
+	  st->bytes_read, st->read_calls, st->buf_growths, st->peak_buf_size,
+	  st->bytes_moved, st->records, st->matches,
+	  st->regnexec_calls, st->reganexec_calls,
+	  st->io_ns / 1e9, st->delim_ns / 1e9, st->match_ns / 1e9,
+	  st->output_ns / 1e9);
+  stats_print_hist_json("record_length_log2_hist", st->reclen_hist);
+  stats_print_hist_json("match_cost_hist", st->cost_hist);
+}
+
+static void
+stats_print_text(const char *title, const struct tre_agrep_stats *st)
+{
+  int i;
 
-      if (next_record == NULL)
+  fprintf(stderr, "%s: stats: %s\n", program_name, title);
+  fprintf(stderr, "  bytes read        %llu in %llu read calls\n",
+	  st->bytes_read, st->read_calls);
+  fprintf(stderr, "  buffer growths    %llu, peak buffer size %llu\n",
+	  st->buf_growths, st->peak_buf_size);
+  fprintf(stderr, "  bytes moved       %llu\n", st->bytes_moved);
+  fprintf(stderr, "  records scanned   %llu, selected %llu\n",
+	  st->records, st->matches);
+  fprintf(stderr, "  tre_regnexec      %llu calls\n", st->regnexec_calls);
+  fprintf(stderr, "  tre_reganexec     %llu calls\n", st->reganexec_calls);
+  fprintf(stderr, "  time (s)          io %.6f, delimiter %.6f, "
+	  "match %.6f, output %.6f\n",
+	  st->io_ns / 1e9, st->delim_ns / 1e9, st->match_ns / 1e9,
+	  st->output_ns / 1e9);
+  fprintf(stderr, "  record length histogram:\n");
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+      if (st->reclen_hist[i] == 0)
+	continue;
+      if (i == 0)
+	fprintf(stderr, "    %-22s %llu\n", "0", st->reclen_hist[i]);
+      else
 	{
-	  int r;
-	  int read_size = buf_size - data_len;
+	  char range[64];
+	  snprintf(range, sizeof(range), "%llu-%llu", 1ULL << (i - 1),
+		   (1ULL << i) - 1);
+	  fprintf(stderr, "    %-22s %llu\n", range, st->reclen_hist[i]);
+	}
+    }
+  fprintf(stderr, "  match cost histogram:\n");
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+      if (st->cost_hist[i] == 0)
+	continue;
+      fprintf(stderr, "    %d%-21s %llu\n", i,
+	      i == STATS_HIST_BUCKETS - 1 ? "+" : "", st->cost_hist[i]);
+    }
+}
 
-	  if (read_size <= 0)
-	    {
-	      /* The buffer is full and no record delimiter found yet,
-		 we need to grow the buffer.  We double the size to
-		 avoid rescanning the data too many times when the
-		 records are very large. */
-	      buf_size *= 2;
-#ifdef SHAW_DEBUG
-          if (opt_debug) {
-              fprintf(stderr, "buf_size=%d\n", buf_size);
-          }
-#endif
-	      buf = realloc(buf, buf_size);
-	      if (buf == NULL)
-		{
-		  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
-		  exit(2);
-		}
-	      read_size = buf_size - data_len;
-	    }
+/* Prints the collected statistics.  This is registered with atexit(),
+   so it also runs when we exit early (e.g. with -q). */
+static void
+stats_print(void)
+{
+  struct tre_agrep_stats total;
+  size_t i;
 
-#ifdef SHAW_DEBUG
-          if (opt_debug) {
-              fprintf(stderr, "read(%d, buf+%d, %d)\n", fd, data_len, read_size);
-          }
-#endif
-	  r = read(fd, buf + data_len, read_size);
+  stats_end_file();
+  fflush(stdout);
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < stats_nfiles; i++)
+    stats_sum(&total, &stats_files[i].stats);
 
-#ifdef SHAW_DEBUG
-      if (opt_debug) {
-          fprintf(stderr, " => %d\n", r);
-      }
-#endif
-	  if (r < 0)
-	    {
-	      /* Read error. */
-	      char *err;
-	      if (errno == EINTR)
-		continue;
-	      err = strerror(errno);
-	      fprintf(stderr, "%s: ", program_name);
-	      fprintf(stderr, _("Error reading from %s: %s\n"), filename, err);
-	      return 1;
-	    }
+  if (stats_mode == STATS_JSON)
+    {
+      fputs("{\"files\":[", stderr);
+      for (i = 0; i < stats_nfiles; i++)
+	{
+	  fputs(i ? ",{\"file\":" : "{\"file\":", stderr);
+	  stats_json_string(stats_files[i].filename);
+	  fputc(',', stderr);
+	  stats_print_json(&stats_files[i].stats);
+	  fputc('}', stderr);
+	}
+      fputs("],\"total\":{", stderr);
+      stats_print_json(&total);
+      fputs("}}\n", stderr);
+    }
+  else
+    {
+      for (i = 0; i < stats_nfiles; i++)
+	stats_print_text(stats_files[i].filename, &stats_files[i].stats);
+      stats_print_text(_("total"), &total);
+    }
+}
 
-	  if (r == 0)
-	    {
-	      /* End of file.  Return the last record. */
-	      record = buf;
-	      record_len = data_len;
-	      at_eof = 1;
-	      /* The empty string after a trailing delimiter is not considered
-		 to be a record. */
-	      if (record_len == 0)
-		return 1;
-	      return 0;
-	    }
-	  data_len += r;
-#ifdef SHAW_DEBUG
-          if (opt_debug) {
-              fprintf(stderr, "data_len=%d\n", data_len);
-          }
-#endif
-	  next_record = buf;
+/* A byte range of a file that holds whole records, and the number of
+   its first record.  With --index, only the ranges that can contain a
+   match are read. */
+struct tre_agrep_range {
+  off_t offset;
+  off_t length;
+  unsigned long long recnum;
+};
+
+static struct tre_agrep_range *ranges; /* Ranges to read, NULL for all. */
+static size_t nranges;
+static size_t next_range;
+static off_t range_left;   /* Bytes left to read in the current range. */
+
+/* Input.  Regular files are read in blocks that grow with their size
+   (see agrep_reader_fit()), and the kernel is told how they are read:
+   from start to end, or, with ranges, each range before it is needed.
+
+   --direct-io is for sweeps over more data than there is memory, which
+   would otherwise push everything else out of the page cache.  Files are
+   read with O_DIRECT through an aligned buffer, or, where the file system
+   does not allow that, normally but dropping each block from the page
+   cache once it has been read. */
+
+#define IO_ALIGN 4096	     /* Enough for the block size of any device. */
+
+static int direct_io;	     /* --direct-io */
+static int io_direct;	     /* The current file is read with O_DIRECT, */
+static int io_drop;	     /* or is dropped from the cache behind us. */
+static char *io_bounce;	     /* Aligned buffer for O_DIRECT, */
+static off_t io_bounce_offset; /* the file offset of its data */
+static size_t io_bounce_len; /* and the length of its data. */
+
+/* Starts reading file `fd', which is regular, from `reader'. */
+static void
+io_start(int fd)
+{
+  if (agrep_reader_fit(&reader, fd) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  io_direct = io_drop = 0;
+  if (direct_io)
+    {
+#ifdef O_DIRECT
+      int flags = fcntl(fd, F_GETFL);
+
+      if (io_bounce == NULL
+	  && posix_memalign((void **)&io_bounce, IO_ALIGN, AGREP_BLOCK_MAX) != 0)
+	io_bounce = NULL;
+      if (io_bounce != NULL && flags >= 0
+	  && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+	{
+	  io_direct = 1;
+	  io_bounce_len = 0;
+	  return;
 	}
+#endif /* O_DIRECT */
+      io_drop = 1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (ranges == NULL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* POSIX_FADV_SEQUENTIAL */
+}
+
+/* Done reading file `fd'. */
+static void
+io_finish(int fd)
+{
+#ifdef O_DIRECT
+  if (io_direct)
+    {
+      /* Standard input is shared with other processes. */
+      int flags = fcntl(fd, F_GETFL);
 
-      /* Find the next record delimiter. */
+      if (flags >= 0)
+	fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+#endif /* O_DIRECT */
+  io_direct = io_drop = 0;
+}
 
-#ifdef SHAW_DEBUG
-      if (opt_debug) {
-          dbg_len = MIN(data_len - (next_record - buf), 32);
-          strncpy(dbg_buf, next_record, dbg_len);
-          dbg_buf[dbg_len] = '\0';
-
-          fprintf(stderr, "tre_regnexec: buf=%p, next_record=%p = buf+%zd\n",
-              buf, next_record, next_record - buf);
-          fputs(" = [", stderr);
-          fshow_str(stderr, dbg_buf);
-          fputs("]\n", stderr);
-      }
-#endif
+#ifdef O_DIRECT
+/* Reads like read(2) from `fd', which has O_DIRECT set, through
+   `io_bounce', whose reads are aligned as O_DIRECT needs. */
+static ssize_t
+io_direct_read(int fd, char *data, size_t len)
+{
+  off_t pos = lseek(fd, 0, SEEK_CUR);
 
-      errcode = tre_regnexec(&delim, next_record, data_len - (next_record - buf),
-			 1, pmatch, 0);
+  if (pos == (off_t)-1)
+    return -1;
+  if (pos < io_bounce_offset
+      || pos >= io_bounce_offset + (off_t)io_bounce_len)
+    {
+      ssize_t r;
+
+      io_bounce_offset = pos & ~(off_t)(IO_ALIGN - 1);
+      io_bounce_len = 0;
+      r = pread(fd, io_bounce, AGREP_BLOCK_MAX, io_bounce_offset);
+      if (r < 0)
+	return -1;
+      io_bounce_len = r;
+      if (pos >= io_bounce_offset + r)
+	return 0;
+    }
+  len = MIN(len, (size_t)(io_bounce_offset + io_bounce_len - pos));
+  memcpy(data, io_bounce + (pos - io_bounce_offset), len);
+  if (lseek(fd, pos + len, SEEK_SET) == (off_t)-1)
+    return -1;
+  return len;
+}
+#endif /* O_DIRECT */
+
+/* Reads up to `len' bytes from file `fd' into `data', like read(2). */
+static ssize_t
+io_read(int fd, char *data, size_t len)
+{
+  ssize_t r;
+
+#ifdef O_DIRECT
+  if (io_direct)
+    {
+      r = io_direct_read(fd, data, len);
+      if (r >= 0 || errno != EINVAL)
+	return r;
+      /* The file system does not support O_DIRECT after all. */
+      io_finish(fd);
+      io_drop = 1;
+    }
+#endif /* O_DIRECT */
+  r = read(fd, data, len);
+#ifdef POSIX_FADV_DONTNEED
+  if (io_drop && r > 0)
+    {
+      off_t pos = lseek(fd, 0, SEEK_CUR);
+
+      if (pos >= r)
+	posix_fadvise(fd, pos - r, r, POSIX_FADV_DONTNEED);
+    }
+#endif /* POSIX_FADV_DONTNEED */
+  return r;
+}
+
+/* Reads the input of the reader from file descriptor `arg', within the
+   current range if there are ranges. */
+static ssize_t
+tre_agrep_read(void *arg, char *data, size_t len)
+{
+  unsigned long long t0 = 0;
+  ssize_t r;
 
+  if (ranges != NULL)
+    len = MIN(len, (size_t)range_left);
+  if (len == 0)
+    return 0;
+  STATS_START(t0);
+  r = io_read((int)(intptr_t)arg, data, len);
+  STATS_STOP(t0, io_ns);
+  STATS_ADD(read_calls, 1);
+  if (follow_current != NULL && (r == 0 || (r < 0 && errno == EAGAIN)))
+    {
+      /* At the end of a followed file, wait for more data, unless the
+	 partial last record has been idle long enough. */
+      struct tre_agrep_follow *f = follow_current;
 
-      switch (errcode)
+      if (r == 0 && !f->regular)
+	f->done = 1;	     /* The writer closed the pipe. */
+      else if (!f->flush_partial)
 	{
-	case REG_OK:
-	  /* Record delimiter found, now we know how long the current
-	     record is. */
-	  record = next_record;
-	  record_len = pmatch[0].rm_so;
-	  delim_len = next_delim_len;
+	  errno = EAGAIN;
+	  return -1;
+	}
+      f->flush_partial = 0;
+      return 0;
+    }
+  if (r <= 0)
+    return r;
+  if (ranges != NULL)
+    range_left -= r;
+  /* Look for NUL bytes in the first block read, which mark the file as
+     binary.  Like GNU grep, only the first block is looked at, so the
+     decision is made before anything of the file is output or counted. */
+  if (!binary_checked)
+    {
+      binary_checked = 1;
+      if (binary_files != BINARY_TEXT && !delim_matches_nul
+	  && memchr(data, '\0', r) != NULL)
+	file_is_binary = 1;
+    }
+  STATS_ADD(bytes_read, r);
+  return r;
+}
 
-	  next_delim_len = pmatch[0].rm_eo - pmatch[0].rm_so;
-	  next_record = next_record + pmatch[0].rm_eo;
-	  return 0;
-	  break;
+/* Starts the reader on file `fd' at the start of the next range.
+   Returns 0 when there are no more ranges to read. */
+static int
+tre_agrep_next_range(int fd, const char *filename)
+{
+  const struct tre_agrep_range *r;
 
-	case REG_NOMATCH:
-	  if (next_record == buf)
-	    {
-	      next_record = NULL;
-	      continue;
-	    }
+  if (ranges == NULL || next_range >= nranges)
+    return 0;
+  r = &ranges[next_range++];
+  if (lseek(fd, r->offset, SEEK_SET) == (off_t)-1)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+      return 0;
+    }
+  range_left = r->length;
+  agrep_reader_start(&reader, tre_agrep_read, (void *)(intptr_t)fd,
+		     r->offset, r->recnum - 1);
+#ifdef POSIX_FADV_WILLNEED
+  /* Have the next range read ahead while this one is searched. */
+  if (next_range < nranges && !io_direct)
+    posix_fadvise(fd, ranges[next_range].offset, ranges[next_range].length,
+		  POSIX_FADV_WILLNEED);
+#endif /* POSIX_FADV_WILLNEED */
+  return 1;
+}
 
-#ifdef SHAW_DEBUG
-      if (opt_debug) {
-          /* Move the data to start of the buffer and read more data. */
-          fprintf(stderr, "memmove:\n");
-          fprintf(stderr, "    buf=%p\n", buf);
-          fprintf(stderr, "    next_record=%p = buf+%zd\n",
-                  next_record, next_record - buf);
-          fprintf(stderr, "    data_len=%d\n", data_len);
-
-          dbg_len = MIN(data_len, 32);
-          strncpy(dbg_buf, buf, dbg_len);
-          dbg_buf[dbg_len] = '\0';
-          fprintf(stderr, "    @buf          [");
-          fshow_str(stderr, dbg_buf);
-          fprintf(stderr, "]\n");
-
-          dbg_len = MIN(data_len - (next_record - buf), 32);
-          strncpy(dbg_buf, next_record, dbg_len);
-          dbg_buf[dbg_len] = '\0';
-          fprintf(stderr, "    @next_record  [");
-          fshow_str(stderr, dbg_buf);
-          fprintf(stderr, "]\n");
-
-          fprintf(stderr, "memmove(buf=%p <- next_record=%p, %zd)\n",
-                  buf, next_record, buf + data_len - next_record);
-          memmove(buf, next_record, buf + data_len - next_record);
-          data_len = buf + data_len - next_record;
-          fprintf(stderr, "After memmove:\n");
-          fprintf(stderr, "    data_len=%d\n", data_len);
-      }
-      else {
-          memmove(buf, next_record, buf + data_len - next_record);
-          data_len = buf + data_len - next_record;
-      }
-#else
-        /* Move the data to start of the buffer and read more data. */
-        memmove(buf, next_record, buf + data_len - next_record);
-        data_len = buf + data_len - next_record;
-#endif /* SHAW_DEBUG */
+/* A string that every selected record contains, if records without it
+   are skipped in bulk (see main()). */
+static const char *skip_string;
+static size_t skip_len;
 
-	  next_record = NULL;
-	  continue;
-	  break;
+/* Moves `reader' to the next complete record from file `fd'.  Returns 1
+   when there are no more records, 0 otherwise. */
+static inline int
+tre_agrep_get_next_record(int fd, const char *filename)
+{
+  while (1)
+    {
+      int r;
 
-	case REG_ESPACE:
-	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
-	  exit(2);
-	  break;
+      if (skip_string != NULL)
+	agrep_reader_skip(&reader, skip_string, skip_len);
+      r = agrep_reader_next(&reader);
 
-	default:
-	  assert(0);
-	  break;
+      if (r > 0)
+	return 0;
+      if (r < 0)
+	{
+	  if (errno == EAGAIN && follow_current != NULL)
+	    return 1;	     /* Wait for more data. */
+	  if (errno == ENOMEM)
+	    {
+	      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	      exit(2);
+	    }
+	  fprintf(stderr, "%s: ", program_name);
+	  fprintf(stderr, _("Error reading from %s: %s\n"), filename,
+		  strerror(errno));
+	  return 1;
 	}
+      /* End of the input, or of the current range. */
+      if (follow_current != NULL && !follow_current->done)
+	{
+	  /* A followed file goes on after its partial last record. */
+	  agrep_reader_start(&reader, tre_agrep_read, (void *)(intptr_t)fd,
+			     reader.buf_offset + reader.data_len,
+			     reader.recnum);
+	  continue;
+	}
+      if (!tre_agrep_next_range(fd, filename))
+	return 1;
     }
 }
 
 static void
-print_indent(size_t indent)
+print_indent(FILE *out, size_t indent)
 {
     size_t i;
 
     for (i = 0; i < indent; ++i) {
-        fputc(' ', stdout);
+        fputc(' ', out);
     }
 }
 
 static void
-print_record_indent(char *rec, size_t len, size_t *colp)
+print_record_indent(FILE *out, const char *rec, size_t len, size_t *colp)
 {
     size_t pos;
     size_t col;
@@ -496,256 +1103,4159 @@ print_record_indent(char *rec, size_t len, size_t *colp)
         }
         else {
             if (col == 0) {
-                print_indent(indent);
+                print_indent(out, indent);
                 col += indent;
             }
             ++col;
         }
-        fputc(c, stdout);
+        fputc(c, out);
     }
     *colp = col;
 }
 
-static int
-tre_agrep_handle_file(const char *filename)
-{
-  int fd;
-  int count = 0;
-  int recnum = 0;
+/* Text output of selected records, shared by tre_agrep_search_records()
+   and the -r workers, which write to memory (see walk_search()).  The
+   workers run without --indent, so only the main thread gets to the
+   `prev_filename' update. */
 
-  /* Allocate the initial buffer. */
-  if (buf == NULL)
+/* Writes the `FILE:RECNUM:OFFSET:COST:START-END:' prefixes asked for
+   before the current record of `rd', selected with `m'. */
+static void
+print_prefix(FILE *out, const char *filename, const struct agrep_reader *rd,
+	     const struct agrep_match *m)
+{
+  if (print_filename
+      && !(indent && prev_filename != NULL
+	   && strcmp(filename, prev_filename) == 0))
     {
-      buf = malloc(INITIAL_BUF_SIZE);
-      if (buf == NULL)
+      fprintf(out, "%s:", filename);
+      if (indent != 0)
 	{
-	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
-	  exit(2);
+	  free(prev_filename);
+	  prev_filename = strdup(filename);
+	  fputc('\n', out);
 	}
-      buf_size = INITIAL_BUF_SIZE;
     }
+  if (print_recnum)
+    fprintf(out, "%llu:", rd->recnum);
+  if (print_byte_offset)
+    fprintf(out, "%lld:", (long long)agrep_reader_offset(rd));
+  if (print_cost)
+    fprintf(out, "%d:", m->cost);
+  if (print_position)
+    fprintf(out, "%lld-%lld:",
+	    invert_match ? 0 : (long long)m->so,
+	    invert_match ? (long long)rd->record_len : (long long)m->eo);
+}
 
-  /* Reset read buffer state. */
-  next_record = NULL;
-  data_len = 0;
-
-  if (!filename || strcmp(filename, "-") == 0)
+/* Widens the current record of `rd', `*record' and `*record_len', to
+   take in the delimiter printed with it: the one after it with -M, else
+   the one before it.  Returns the number of bytes added in front. */
+static size_t
+print_span(const struct agrep_reader *rd, char **record, size_t *record_len)
+{
+  if (delim_after)
     {
-      if (best_match)
-	{
-	  fprintf(stderr, "%s: %s\n", program_name,
-		  _("Cannot use -B when reading from standard input."));
-	  return 2;
-	}
-      fd = 0;
-      filename = _("(standard input)");
+      *record_len += rd->next_delim_len;
+      return 0;
     }
-  else
-    {
-      fd = open(filename, O_RDONLY);
+  if ((size_t)(*record - rd->buf) < rd->delim_len)
+    return 0;
+  *record -= rd->delim_len;
+  *record_len += rd->delim_len;
+  return rd->delim_len;
+}
+
+/* Writes the current record of `rd' with its prefixes and delimiter. */
+static void
+print_record(FILE *out, const char *filename, const struct agrep_reader *rd,
+	     const struct agrep_match *m)
+{
+  char *record = rd->record;
+  size_t record_len = rd->record_len;
+
+  print_prefix(out, filename, rd, m);
+  print_span(rd, &record, &record_len);
+  if (indent != 0)
+    {
+      size_t col = 0;
+      print_record_indent(out, record, record_len, &col);
     }
+  else
+    fwrite(record, 1, record_len, out);
+}
 
-  if (fd < 0)
+/* Says that binary file `filename' has a selected record, instead of
+   dumping it on the terminal. */
+static void
+print_binary_match(FILE *out, const char *filename)
+{
+  fprintf(out, _("Binary file %s matches\n"), filename);
+}
+
+/* Writes the -c line of `filename'. */
+static void
+print_count(FILE *out, const char *filename, unsigned long long count)
+{
+  if (print_filename)
+    fprintf(out, "%s:", filename);
+  fprintf(out, "%llu\n", count);
+}
+
+/* Structured output (--output=ndjson and --output=binary), for programs
+   that would otherwise have to parse the `file:recnum:cost:' prefixes,
+   which are ambiguous when names or records contain colons.
+
+   With ndjson, each selected record is one line:
+
+     {"file":"a.log","record":12,"offset":3456,"cost":1,
+      "spans":[[4,9],[20,25]],"text":"..."}
+
+   "text" is "text_base64" instead if the record is not valid UTF-8, and
+   likewise "file" is "file_base64".  The binary format starts with the
+   8 bytes "AGREPR1\n", followed by one frame per record, with all
+   integers big-endian:
+
+     u32 filename length, filename, u64 record number, u64 offset,
+     u32 cost, u32 number of spans, u64 start and end of each span,
+     u64 record length, record
+
+   Records are without their delimiters, offsets are in the
+   (decompressed) input, and spans are all the matches in the record as
+   --color shows them.  Records selected with -v have no spans, and their
+   cost is null, or 0xffffffff in the binary format.
+
+   Everything goes through `out_buf', which is written to stdout when it
+   fills up and after each file. */
+
+#define OUT_BUF_SIZE (64 * 1024)
+
+static char *out_buf;
+static size_t out_len;
+static int out_started;	     /* The binary header was written. */
+static size_t *out_spans;    /* Start and end of each span. */
+static size_t out_spans_size;
+
+static void
+out_flush(void)
+{
+  if (out_len > 0)
+    fwrite(out_buf, 1, out_len, stdout);
+  out_len = 0;
+}
+
+/* Makes room for `n' more bytes, which must be at most OUT_BUF_SIZE. */
+static char *
+out_reserve(size_t n)
+{
+  if (out_buf == NULL)
     {
-      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
-      return 1;
+      out_buf = malloc(OUT_BUF_SIZE);
+      if (out_buf == NULL)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+    }
+  if (out_len + n > OUT_BUF_SIZE)
+    out_flush();
+  return out_buf + out_len;
+}
+
+static void
+out_bytes(const void *p, size_t n)
+{
+  if (n >= OUT_BUF_SIZE)
+    {
+      out_flush();
+      fwrite(p, 1, n, stdout);
+      return;
     }
+  memcpy(out_reserve(n), p, n);
+  out_len += n;
+}
 
+#define out_str(s) out_bytes(s, sizeof(s) - 1)
 
-  /* Go through all records and output the matching ones, or the non-matching
-     ones if `invert_match' is true. */
-  at_eof = 0;
-  while (!tre_agrep_get_next_record(fd, filename))
+static void
+out_u32(uint32_t v)
+{
+  unsigned char *p = (unsigned char *)out_reserve(4);
+
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  out_len += 4;
+}
+
+static void
+out_u64(uint64_t v)
+{
+  out_u32(v >> 32);
+  out_u32(v);
+}
+
+/* Decimal. */
+static void
+out_uint(unsigned long long v)
+{
+  char tmp[20], *p = tmp + sizeof(tmp);
+
+  do
+    *--p = '0' + v % 10;
+  while ((v /= 10) != 0);
+  out_bytes(p, tmp + sizeof(tmp) - p);
+}
+
+/* Returns 1 if `len' bytes at `s' are valid UTF-8. */
+static int
+utf8_valid(const unsigned char *s, size_t len)
+{
+  const unsigned char *end = s + len;
+
+  while (s < end)
     {
-      int errcode;
-      regamatch_t match;
-      regmatch_t pmatch[1];
-      recnum++;
-      memset(&match, 0, sizeof(match));
-      if (best_match)
-	match_params.max_cost = best_cost;
-      if (color_option || print_position)
+      unsigned c = *s, min;
+      int n;
+
+      if (c < 0x80)
+	{
+	  s++;
+	  continue;
+	}
+      if (c >= 0xc2 && c <= 0xdf)
+	n = 1, min = 0x80;
+      else if (c >= 0xe0 && c <= 0xef)
+	n = 2, min = 0x800;
+      else if (c >= 0xf0 && c <= 0xf4)
+	n = 3, min = 0x10000;
+      else
+	return 0;
+      if (end - s <= n)
+	return 0;
+      c &= 0x3f >> n;
+      while (n-- > 0)
 	{
-	  match.pmatch = pmatch;
-	  match.nmatch = 1;
+	  if ((*++s & 0xc0) != 0x80)
+	    return 0;
+	  c = (c << 6) | (*s & 0x3f);
 	}
+      if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+	return 0;
+      s++;
+    }
+  return 1;
+}
 
-      /* Stop searching for better matches if an exact match is found. */
-      if (best_match == 1 && best_cost == 0)
-	break;
+/* Writes `len' bytes of valid UTF-8 as the contents of a JSON string.
+   Runs of bytes that need no escape are copied at once. */
+static void
+out_json_chars(const unsigned char *s, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *end = s + len, *run = s;
 
-      /* See if the record matches. */
-      errcode = tre_reganexec(&preg, record, record_len, &match, match_params, 0);
+  for (; s < end; s++)
+    {
+      char *p;
 
+      if (*s >= 0x20 && *s != '"' && *s != '\\')
+	continue;
+      out_bytes(run, s - run);
+      run = s + 1;
+      p = out_reserve(6);
+      p[0] = '\\';
+      if (*s == '"' || *s == '\\')
+	p[1] = *s, out_len += 2;
+      else if (*s == '\n')
+	p[1] = 'n', out_len += 2;
+      else if (*s == '\t')
+	p[1] = 't', out_len += 2;
+      else
+	{
+	  memcpy(p + 1, "u00", 3);
+	  p[4] = hex[*s >> 4];
+	  p[5] = hex[*s & 15];
+	  out_len += 6;
+	}
+    }
+  out_bytes(run, s - run);
+}
 
-#ifdef SHAW_DEBUG
-      if (opt_debug) {
-          if (str_in_mem_region(record, record_len, "Title: Beginning Scala") != NULL) {
-              fprintf(stderr, "Got Title: Beginning Scala\n");
-              fprintf(stderr, "    errcode=%d\n", errcode);
-          }
+static void
+out_base64(const unsigned char *s, size_t len)
+{
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-          if (!invert_match && str_in_mem_region(record, record_len, "Title: Beginning Scala") != NULL && errcode != REG_OK) {
-              fprintf(stderr, "Should have matched.\n");
-          }
-      }
-#endif
+  while (len > 0)
+    {
+      /* Whole groups of 3 bytes, as many as fit in the buffer. */
+      size_t n = MIN(len / 3, OUT_BUF_SIZE / 4);
+      char *p;
 
-      if ((!invert_match && errcode == REG_OK)
-	  || (invert_match && errcode == REG_NOMATCH))
+      if (n == 0)
 	{
+	  unsigned v = s[0] << 16 | (len > 1 ? s[1] << 8 : 0);
 
-#ifdef SHAW_DEBUG
-          if (opt_debug) {
-              fprintf(stderr, "Found match.\n");
-              fprintf(stderr, "    best_match=%d\n", best_match);
-          }
-#endif
+	  p = out_reserve(4);
+	  p[0] = b64[v >> 18];
+	  p[1] = b64[(v >> 12) & 63];
+	  p[2] = len > 1 ? b64[(v >> 6) & 63] : '=';
+	  p[3] = '=';
+	  out_len += 4;
+	  break;
+	}
+      p = out_reserve(n * 4);
+      out_len += n * 4;
+      len -= n * 3;
+      while (n-- > 0)
+	{
+	  unsigned v = s[0] << 16 | s[1] << 8 | s[2];
 
-	  if (be_silent)
-	    exit(0);
- 
-	  count++;
-	  have_matches = 1;
-	  if (best_match)
+	  *p++ = b64[v >> 18];
+	  *p++ = b64[(v >> 12) & 63];
+	  *p++ = b64[(v >> 6) & 63];
+	  *p++ = b64[v & 63];
+	  s += 3;
+	}
+    }
+}
+
+/* Writes `"key":"..."' with the `len' bytes at `s', or
+   `"key_base64":"..."' if they are not UTF-8. */
+static void
+out_json_bytes(const char *key, const char *s, size_t len)
+{
+  int text = utf8_valid((const unsigned char *)s, len);
+
+  out_bytes("\"", 1);
+  out_bytes(key, strlen(key));
+  if (text)
+    {
+      out_str("\":\"");
+      out_json_chars((const unsigned char *)s, len);
+    }
+  else
+    {
+      out_str("_base64\":\"");
+      out_base64((const unsigned char *)s, len);
+    }
+  out_bytes("\"", 1);
+}
+
+/* Outputs the current record, `len' bytes at `rec', of `filename', whose
+   first match is in `m'. */
+static void
+output_record(const char *filename, char *rec, size_t len,
+	      const struct agrep_match *m)
+{
+  size_t nspans = 0, name_len = strlen(filename), i;
+
+  /* Find all the matches, like --color. */
+  if (m->matched && m->so >= 0)
+    {
+      struct agrep_match next = *m;
+      size_t pos = 0;
+
+      for (;;)
+	{
+	  if (2 * nspans + 2 > out_spans_size)
 	    {
-	      if (best_match == 1)
+	      size_t size = out_spans_size ? out_spans_size * 2 : 32;
+	      size_t *spans = realloc(out_spans, size * sizeof(*spans));
+
+	      if (spans == NULL)
 		{
-		  /* First best match pass. */
-		  if (match.cost < best_cost)
-		    best_cost = match.cost;
-		  continue;
+		  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+		  exit(2);
 		}
-	      /* Second best match pass. */
-	      if (match.cost > best_cost)
-		continue;
+	      out_spans = spans;
+	      out_spans_size = size;
+	    }
+	  out_spans[2 * nspans] = pos + next.so;
+	  out_spans[2 * nspans + 1] = pos + next.eo;
+	  nspans++;
+	  /* Step over an empty match, so that the search moves on. */
+	  pos += next.eo > next.so ? next.eo : next.eo + 1;
+	  if (pos >= len)
+	    break;
+	  if (agrep_searcher_match(&searcher, rec + pos, len - pos, &next) < 0)
+	    {
+	      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	      exit(2);
 	    }
+	  STATS_ADD(reganexec_calls, 1);
+	  if (!next.matched)
+	    break;
+	}
+    }
 
-	  if (list_files)
+  if (output_format == OUTPUT_BINARY)
+    {
+      if (!out_started)
+	out_str("AGREPR1\n");
+      out_started = 1;
+      out_u32(name_len);
+      out_bytes(filename, name_len);
+      out_u64(reader.recnum);
+      out_u64(agrep_reader_offset(&reader));
+      out_u32(m->matched ? (uint32_t)m->cost : 0xffffffff);
+      out_u32(nspans);
+      for (i = 0; i < 2 * nspans; i++)
+	out_u64(out_spans[i]);
+      out_u64(len);
+      out_bytes(rec, len);
+      return;
+    }
+
+  out_bytes("{", 1);
+  out_json_bytes("file", filename, name_len);
+  out_str(",\"record\":");
+  out_uint(reader.recnum);
+  out_str(",\"offset\":");
+  out_uint(agrep_reader_offset(&reader));
+  out_str(",\"cost\":");
+  if (m->matched)
+    out_uint(m->cost);
+  else
+    out_str("null");
+  out_str(",\"spans\":[");
+  for (i = 0; i < nspans; i++)
+    {
+      if (i > 0)
+	out_bytes(",", 1);
+      out_bytes("[", 1);
+      out_uint(out_spans[2 * i]);
+      out_bytes(",", 1);
+      out_uint(out_spans[2 * i + 1]);
+      out_bytes("]", 1);
+    }
+  out_str("],");
+  out_json_bytes("text", rec, len);
+  out_str("}\n");
+}
+
+
+#ifdef HAVE_DECOMPRESS
+
+/* Compressed input is decompressed by a separate thread, which writes
+   the plain data to a pipe.  The reader in tre_agrep_get_next_record()
+   reads from the pipe as if it were the file, so record numbers and
+   filenames come out as if the file were not compressed, and
+   decompression overlaps with matching. */
+
+enum {
+  COMPRESS_NONE,
+  COMPRESS_GZIP,
+  COMPRESS_XZ,
+  COMPRESS_ZSTD
+};
+
+#define COMPRESS_MAGIC_LEN 6
+#define DECOMPRESS_IN_SIZE (128 * 1024)
+#define DECOMPRESS_OUT_SIZE (256 * 1024)
+
+struct tre_agrep_decompress {
+  pthread_t thread;
+  int format;		   /* One of COMPRESS_*. */
+  int in_fd;		   /* Compressed input. */
+  int out_fd;		   /* Write end of the pipe. */
+  int pipe_fd;		   /* Read end of the pipe. */
+  const char *filename;
+  /* Bytes already read from `in_fd' to look at the magic number. */
+  unsigned char prefix[COMPRESS_MAGIC_LEN];
+  size_t prefix_len;
+};
+
+/* Returns the compression format with magic number `magic', if we have
+   a decoder for it. */
+static int
+compress_format(const unsigned char *magic, size_t len)
+{
+#ifdef HAVE_ZLIB
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return COMPRESS_GZIP;
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_LZMA
+  if (len >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+    return COMPRESS_XZ;
+#endif /* HAVE_LZMA */
+#ifdef HAVE_ZSTD
+  if (len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+    return COMPRESS_ZSTD;
+#endif /* HAVE_ZSTD */
+  return COMPRESS_NONE;
+}
+
+static void
+decompress_error(struct tre_agrep_decompress *dec, const char *msg)
+{
+  fprintf(stderr, "%s: %s: %s: %s\n", program_name, dec->filename,
+	  _("Decompression failed"), msg);
+}
+
+/* Reads compressed input, starting with the sniffed prefix. */
+static ssize_t
+decompress_read(struct tre_agrep_decompress *dec, void *data, size_t size)
+{
+  ssize_t r;
+
+  if (dec->prefix_len > 0)
+    {
+      r = MIN(size, dec->prefix_len);
+      memcpy(data, dec->prefix, r);
+      memmove(dec->prefix, dec->prefix + r, dec->prefix_len - r);
+      dec->prefix_len -= r;
+      return r;
+    }
+  do
+    r = read(dec->in_fd, data, size);
+  while (r < 0 && errno == EINTR);
+  if (r < 0)
+    decompress_error(dec, strerror(errno));
+  return r;
+}
+
+/* Writes decompressed data to the pipe.  Fails quietly with EPIPE when
+   the reader has stopped early, e.g. with -l. */
+static int
+decompress_write(struct tre_agrep_decompress *dec, const void *data,
+		 size_t len)
+{
+  const char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t w = write(dec->out_fd, p, len);
+      if (w < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EPIPE)
+	    decompress_error(dec, strerror(errno));
+	  return -1;
+	}
+      p += w;
+      len -= w;
+    }
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+static void
+decompress_gzip(struct tre_agrep_decompress *dec, unsigned char *in,
+		unsigned char *out)
+{
+  z_stream z;
+  int ret;
+  int members = 0;	   /* Complete gzip members seen. */
+  int in_member = 0;	   /* Part of a member has been decoded. */
+
+  memset(&z, 0, sizeof(z));
+  /* 15 + 32: maximum window, and detect gzip or zlib headers. */
+  if (inflateInit2(&z, 15 + 32) != Z_OK)
+    {
+      decompress_error(dec, _("Out of memory"));
+      return;
+    }
+
+  while (1)
+    {
+      if (z.avail_in == 0)
+	{
+	  ssize_t r = decompress_read(dec, in, DECOMPRESS_IN_SIZE);
+	  if (r < 0)
+	    break;
+	  if (r == 0)
 	    {
-	      printf("%s\n", filename);
+	      if (in_member)
+		decompress_error(dec, _("Unexpected end of file"));
 	      break;
 	    }
-	  else if (!count_matches)
-	    {
-            if (print_filename && !(indent && prev_filename != NULL && strcmp(filename, prev_filename) == 0)) {
-                printf("%s:", filename);
-                prev_filename = strdup(filename);
-                if (indent != 0) {
-                    fputc('\n', stdout);
-                }
-            }
-	      if (print_recnum)
-		printf("%d:", recnum);
-	      if (print_cost)
-		printf("%d:", match.cost);
-	      if (print_position)
-		printf("%d-%d:",
-		       invert_match ? 0 : (int)pmatch[0].rm_so,
-		       invert_match ? record_len : (int)pmatch[0].rm_eo);
-
-	      /* Adjust record boundaries so we print the delimiter
-		 before or after the record. */
-	      if (delim_after)
-		{
-		  record_len += next_delim_len;
-		}
-	      else
-		{
-			if (record - buf >= delim_len) {
-			  record -= delim_len;
-			  record_len += delim_len;
-			  pmatch[0].rm_so += delim_len;
-			  pmatch[0].rm_eo += delim_len;
-			}
-		}
+	  z.next_in = in;
+	  z.avail_in = r;
+	}
+      z.next_out = out;
+      z.avail_out = DECOMPRESS_OUT_SIZE;
+      ret = inflate(&z, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+	{
+	  /* Like gzip, ignore trailing garbage (e.g. tar padding) after
+	     the last complete member. */
+	  if (!(members > 0 && !in_member))
+	    decompress_error(dec, z.msg ? z.msg : _("Corrupt data"));
+	  break;
+	}
+      if (decompress_write(dec, out, DECOMPRESS_OUT_SIZE - z.avail_out) != 0)
+	break;
+      if (ret == Z_STREAM_END)
+	{
+	  /* Concatenated gzip files are valid gzip files. */
+	  members++;
+	  in_member = 0;
+	  inflateReset(&z);
+	}
+      else
+	in_member = 1;
+    }
+  inflateEnd(&z);
+}
+#endif /* HAVE_ZLIB */
 
-          if (color_option && !invert_match) {
+#ifdef HAVE_LZMA
+static void
+decompress_xz(struct tre_agrep_decompress *dec, unsigned char *in,
+	      unsigned char *out)
+{
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_action action = LZMA_RUN;
+  lzma_ret ret;
 
-              /*
-               * Look for more than one match.
-               * Instead of printing the trailing context after the first match,
-               * continue looking for more matches.
-               *
-               */
+  if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+    {
+      decompress_error(dec, _("Out of memory"));
+      return;
+    }
+
+  while (1)
+    {
+      if (strm.avail_in == 0 && action == LZMA_RUN)
+	{
+	  ssize_t r = decompress_read(dec, in, DECOMPRESS_IN_SIZE);
+	  if (r < 0)
+	    break;
+	  if (r == 0)
+	    action = LZMA_FINISH;
+	  strm.next_in = in;
+	  strm.avail_in = r;
+	}
+      strm.next_out = out;
+      strm.avail_out = DECOMPRESS_OUT_SIZE;
+      ret = lzma_code(&strm, action);
+      if (decompress_write(dec, out, DECOMPRESS_OUT_SIZE - strm.avail_out) != 0)
+	break;
+      if (ret == LZMA_STREAM_END)
+	break;
+      if (ret != LZMA_OK)
+	{
+	  decompress_error(dec, ret == LZMA_MEM_ERROR ? _("Out of memory")
+			   : ret == LZMA_BUF_ERROR ? _("Unexpected end of file")
+			   : _("Corrupt data"));
+	  break;
+	}
+    }
+  lzma_end(&strm);
+}
+#endif /* HAVE_LZMA */
+
+#ifdef HAVE_ZSTD
+static void
+decompress_zstd(struct tre_agrep_decompress *dec, unsigned char *in,
+		unsigned char *out)
+{
+  ZSTD_DStream *zds;
+  ZSTD_inBuffer zin = { in, 0, 0 };
+  size_t ret = 0;
+
+  zds = ZSTD_createDStream();
+  if (zds == NULL || ZSTD_isError(ZSTD_initDStream(zds)))
+    {
+      decompress_error(dec, _("Out of memory"));
+      ZSTD_freeDStream(zds);
+      return;
+    }
+
+  while (1)
+    {
+      ZSTD_outBuffer zout = { out, DECOMPRESS_OUT_SIZE, 0 };
+
+      if (zin.pos == zin.size)
+	{
+	  ssize_t r = decompress_read(dec, in, DECOMPRESS_IN_SIZE);
+	  if (r < 0)
+	    break;
+	  if (r == 0)
+	    {
+	      /* A non-zero hint means a frame is not complete. */
+	      if (ret != 0)
+		decompress_error(dec, _("Unexpected end of file"));
+	      break;
+	    }
+	  zin.size = r;
+	  zin.pos = 0;
+	}
+      /* Frames are decoded one after another, so concatenated zstd
+	 files work. */
+      ret = ZSTD_decompressStream(zds, &zout, &zin);
+      if (ZSTD_isError(ret))
+	{
+	  decompress_error(dec, ZSTD_getErrorName(ret));
+	  break;
+	}
+      if (decompress_write(dec, out, zout.pos) != 0)
+	break;
+    }
+  ZSTD_freeDStream(zds);
+}
+#endif /* HAVE_ZSTD */
+
+static void *
+decompress_thread(void *arg)
+{
+  struct tre_agrep_decompress *dec = arg;
+  unsigned char *in, *out;
+  sigset_t set;
+
+  /* Get EPIPE instead of SIGPIPE if the reader goes away early. */
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  in = malloc(DECOMPRESS_IN_SIZE);
+  out = malloc(DECOMPRESS_OUT_SIZE);
+  if (in == NULL || out == NULL)
+    decompress_error(dec, _("Out of memory"));
+  else
+    switch (dec->format)
+      {
+#ifdef HAVE_ZLIB
+      case COMPRESS_GZIP:
+	decompress_gzip(dec, in, out);
+	break;
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_LZMA
+      case COMPRESS_XZ:
+	decompress_xz(dec, in, out);
+	break;
+#endif /* HAVE_LZMA */
+#ifdef HAVE_ZSTD
+      case COMPRESS_ZSTD:
+	decompress_zstd(dec, in, out);
+	break;
+#endif /* HAVE_ZSTD */
+      default:
+	{
+	  /* -Z on input that turned out not to be compressed. */
+	  ssize_t r;
+	  while ((r = decompress_read(dec, in, DECOMPRESS_IN_SIZE)) > 0)
+	    if (decompress_write(dec, in, r) != 0)
+	      break;
+	}
+	break;
+      }
+  free(in);
+  free(out);
+  close(dec->out_fd);
+  return NULL;
+}
+
+/* Looks at the start of `fd' and, if it is compressed, starts a
+   decompression thread for it.  Returns 1 if the caller should read
+   from `dec->pipe_fd' instead of `fd', 0 to read `fd' as it is, and -1
+   on errors. */
+static int
+decompress_start(struct tre_agrep_decompress *dec, int fd,
+		 const char *filename)
+{
+  struct stat st;
+  int pfd[2];
+  ssize_t r;
+
+  memset(dec, 0, sizeof(*dec));
+  dec->in_fd = fd;
+  dec->filename = filename;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+      /* Regular files can be sniffed without consuming anything. */
+      r = pread(fd, dec->prefix, COMPRESS_MAGIC_LEN, 0);
+      if (r <= 0)
+	return 0;
+      dec->format = compress_format(dec->prefix, r);
+      if (dec->format == COMPRESS_NONE)
+	return 0;
+    }
+  else if (force_decompress)
+    {
+      /* The bytes we look at are gone from a pipe, so pass them on to
+	 the thread, which also copies input that is not compressed. */
+      while (dec->prefix_len < COMPRESS_MAGIC_LEN)
+	{
+	  r = read(fd, dec->prefix + dec->prefix_len,
+		   COMPRESS_MAGIC_LEN - dec->prefix_len);
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  if (r < 0)
+	    {
+	      fprintf(stderr, "%s: ", program_name);
+	      fprintf(stderr, _("Error reading from %s: %s\n"), filename,
+		      strerror(errno));
+	      return -1;
+	    }
+	  if (r == 0)
+	    break;
+	  dec->prefix_len += r;
+	}
+      dec->format = compress_format(dec->prefix, dec->prefix_len);
+    }
+  else
+    return 0;
+
+  if (pipe(pfd) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+      return -1;
+    }
+#ifdef F_SETPIPE_SZ
+  /* A bigger pipe means fewer context switches between the threads. */
+  fcntl(pfd[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif /* F_SETPIPE_SZ */
+  dec->pipe_fd = pfd[0];
+  dec->out_fd = pfd[1];
+  errno = pthread_create(&dec->thread, NULL, decompress_thread, dec);
+  if (errno != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+      close(pfd[0]);
+      close(pfd[1]);
+      return -1;
+    }
+  return 1;
+}
+
+/* Stops reading decompressed data and waits for the thread. */
+static void
+decompress_finish(struct tre_agrep_decompress *dec)
+{
+  close(dec->pipe_fd);
+  pthread_join(dec->thread, NULL);
+}
+
+#endif /* HAVE_DECOMPRESS */
+
+/* The q-gram index (--build-index, --index).
+
+   Each file is cut into blocks of whole records of about
+   INDEX_BLOCK_SIZE bytes.  For every q-gram (hashed, ASCII case folded)
+   the index has a posting list of the blocks whose records contain it,
+   stored as delta-encoded varints.  A search for a literal pattern of
+   m bytes with at most k edits needs at least (m - q + 1) - k * (q +
+   MB_CUR_MAX - 1) of the pattern's q-grams in the record (each edit
+   destroys at most that many), so blocks with fewer can be skipped.
+   Files that are not in the index or have changed since it was built
+   are searched in full.
+
+   The index file is written in host byte order; an index built on a
+   machine with different byte order is ignored. */
+
+#define INDEX_FILENAME "agrep.idx"
+#define INDEX_MAGIC "AGRPQIX1"
+#define INDEX_VERSION 1
+#define INDEX_BYTE_ORDER 0x01020304
+#define INDEX_Q 3
+#define INDEX_BUCKET_BITS 18
+#define INDEX_NBUCKETS (1 << INDEX_BUCKET_BITS)
+#define INDEX_BLOCK_SIZE (64 * 1024)
+#define INDEX_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct tre_agrep_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t q;
+  uint32_t bucket_bits;
+  uint64_t nfiles;
+  uint64_t nblocks;
+  uint64_t files_size;	   /* Size of the file table in bytes. */
+  uint64_t postings_size;  /* Size of all posting lists in bytes. */
+  uint32_t delim_len;	   /* Length of the -d pattern that follows. */
+  uint32_t pad;
+};
+
+/* An entry of the file table, followed by the path, padded to 8. */
+struct tre_agrep_index_file {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t first_block;
+  uint64_t nblocks;
+  uint32_t path_len;
+  uint32_t pad;
+};
+
+struct tre_agrep_index_block {
+  uint64_t offset;
+  uint64_t length;
+  uint64_t recnum;	   /* Number of the first record in the block. */
+};
+
+/* The layout of the index file is: header, -d pattern, file table
+   (sorted by path), block table, INDEX_NBUCKETS + 1 offsets into the
+   posting lists, posting lists. */
+
+static inline uint32_t
+index_bucket(const unsigned char *p)
+{
+  uint32_t gram = 0;
+  int i;
+
+  for (i = 0; i < INDEX_Q; i++)
+    gram = (gram << 8) | (p[i] >= 'A' && p[i] <= 'Z' ? p[i] + 'a' - 'A'
+			  : p[i]);
+  return (gram * 2654435761u) >> (32 - INDEX_BUCKET_BITS);
+}
+
+/* State for --build-index. */
+struct tre_agrep_posting {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  uint64_t last;	   /* Last block added, plus one. */
+};
+
+struct tre_agrep_index_entry {
+  struct tre_agrep_index_file info;
+  char *path;
+};
+
+static struct tre_agrep_posting *ix_postings;
+static unsigned char *ix_seen;	/* Buckets seen in the current block. */
+static uint32_t *ix_touched;	/* The same buckets, as a list. */
+static size_t ix_ntouched;
+static struct tre_agrep_index_block *ix_blocks;
+static size_t ix_nblocks;
+static size_t ix_blocks_size;
+static struct tre_agrep_index_entry *ix_files;
+static size_t ix_nfiles;
+
+static void
+index_build_init(void)
+{
+  ix_postings = calloc(INDEX_NBUCKETS, sizeof(*ix_postings));
+  ix_seen = calloc(INDEX_NBUCKETS / 8, 1);
+  ix_touched = malloc(INDEX_NBUCKETS * sizeof(*ix_touched));
+  if (ix_postings == NULL || ix_seen == NULL || ix_touched == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+}
+
+static void
+index_add_grams(const char *rec, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + INDEX_Q <= len; i++)
+    {
+      uint32_t b = index_bucket((const unsigned char *)rec + i);
+      if (!(ix_seen[b >> 3] & (1 << (b & 7))))
+	{
+	  ix_seen[b >> 3] |= 1 << (b & 7);
+	  ix_touched[ix_ntouched++] = b;
+	}
+    }
+}
+
+static void
+index_begin_block(off_t offset, unsigned long long first_recnum)
+{
+  if (ix_nblocks == ix_blocks_size)
+    {
+      ix_blocks_size = ix_blocks_size ? ix_blocks_size * 2 : 1024;
+      ix_blocks = xrealloc(ix_blocks, ix_blocks_size * sizeof(*ix_blocks));
+    }
+  ix_blocks[ix_nblocks].offset = offset;
+  ix_blocks[ix_nblocks].length = 0;
+  ix_blocks[ix_nblocks].recnum = first_recnum;
+  ix_nblocks++;
+}
+
+static void
+index_end_block(off_t end)
+{
+  uint64_t block = ix_nblocks - 1;
+  size_t i;
+
+  ix_blocks[block].length = end - ix_blocks[block].offset;
+  for (i = 0; i < ix_ntouched; i++)
+    {
+      struct tre_agrep_posting *p = &ix_postings[ix_touched[i]];
+      uint64_t delta = block + 1 - p->last;
+
+      if (p->len + 10 > p->size)
+	{
+	  p->size = p->size ? p->size * 2 : 16;
+	  p->data = xrealloc(p->data, p->size);
+	}
+      while (delta >= 0x80)
+	{
+	  p->data[p->len++] = (delta & 0x7f) | 0x80;
+	  delta >>= 7;
+	}
+      p->data[p->len++] = delta;
+      p->last = block + 1;
+      ix_seen[ix_touched[i] >> 3] = 0;
+    }
+  ix_ntouched = 0;
+}
+
+/* Adds the records of `fd' to the index being built. */
+static int
+index_add_file(int fd, const char *filename)
+{
+  struct tre_agrep_index_entry *e;
+  struct stat st;
+  off_t end = 0;
+  int in_block = 0;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      fprintf(stderr, _("%s: %s: not a regular file, not indexed\n"),
+	      program_name, filename);
+      return 1;
+    }
+#ifdef HAVE_DECOMPRESS
+  {
+    unsigned char magic[COMPRESS_MAGIC_LEN];
+    ssize_t r = pread(fd, magic, sizeof(magic), 0);
+    if (r > 0 && compress_format(magic, r) != COMPRESS_NONE)
+      {
+	fprintf(stderr, _("%s: %s: compressed, not indexed\n"),
+		program_name, filename);
+	return 1;
+      }
+  }
+#endif /* HAVE_DECOMPRESS */
+
+  ix_files = xrealloc(ix_files, (ix_nfiles + 1) * sizeof(*ix_files));
+  e = &ix_files[ix_nfiles++];
+  memset(e, 0, sizeof(*e));
+  e->path = strdup(filename);
+  if (e->path == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  e->info.dev = st.st_dev;
+  e->info.ino = st.st_ino;
+  e->info.size = st.st_size;
+  e->info.mtime_sec = st.st_mtim.tv_sec;
+  e->info.mtime_nsec = st.st_mtim.tv_nsec;
+  e->info.first_block = ix_nblocks;
+  e->info.path_len = strlen(filename);
+
+  while (!tre_agrep_get_next_record(fd, filename))
+    {
+      off_t offset = agrep_reader_offset(&reader);
+
+      if (!in_block)
+	{
+	  index_begin_block(offset, reader.recnum);
+	  in_block = 1;
+	}
+      index_add_grams(reader.record, reader.record_len);
+      end = offset + reader.record_len + reader.next_delim_len;
+      if (end - (off_t)ix_blocks[ix_nblocks - 1].offset >= INDEX_BLOCK_SIZE)
+	{
+	  index_end_block(end);
+	  in_block = 0;
+	}
+    }
+  if (in_block)
+    index_end_block(end);
+  e->info.nblocks = ix_nblocks - e->info.first_block;
+  return 0;
+}
+
+static int
+index_entry_compare(const void *a, const void *b)
+{
+  return strcmp(((const struct tre_agrep_index_entry *)a)->path,
+		((const struct tre_agrep_index_entry *)b)->path);
+}
+
+/* Writes the index built so far to `dir'.  The index is written to a
+   temporary file first, so a concurrent search never sees a partial
+   index.  Returns the exit status. */
+static int
+index_write(const char *dir, const char *delim_regexp)
+{
+  static const char zeros[8];
+  struct tre_agrep_index_header hdr;
+  char *path, *tmp;
+  uint64_t offset;
+  size_t i;
+  FILE *f;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, dir, strerror(errno));
+      return 2;
+    }
+  path = path_join(dir, INDEX_FILENAME);
+  tmp = malloc(strlen(path) + 32);
+  if (path == NULL || tmp == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      return 2;
+    }
+  sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+  f = fopen(tmp, "wb");
+  if (f == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, tmp, strerror(errno));
+      return 2;
+    }
+
+  qsort(ix_files, ix_nfiles, sizeof(*ix_files), index_entry_compare);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = INDEX_VERSION;
+  hdr.byte_order = INDEX_BYTE_ORDER;
+  hdr.q = INDEX_Q;
+  hdr.bucket_bits = INDEX_BUCKET_BITS;
+  hdr.nfiles = ix_nfiles;
+  hdr.nblocks = ix_nblocks;
+  for (i = 0; i < ix_nfiles; i++)
+    hdr.files_size += sizeof(ix_files[i].info)
+      + INDEX_ALIGN(ix_files[i].info.path_len);
+  for (i = 0; i < INDEX_NBUCKETS; i++)
+    hdr.postings_size += ix_postings[i].len;
+  hdr.delim_len = strlen(delim_regexp);
+
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(delim_regexp, hdr.delim_len, 1, f);
+  fwrite(zeros, INDEX_ALIGN(hdr.delim_len) - hdr.delim_len, 1, f);
+  for (i = 0; i < ix_nfiles; i++)
+    {
+      const struct tre_agrep_index_entry *e = &ix_files[i];
+      fwrite(&e->info, sizeof(e->info), 1, f);
+      fwrite(e->path, e->info.path_len, 1, f);
+      fwrite(zeros, INDEX_ALIGN(e->info.path_len) - e->info.path_len, 1, f);
+    }
+  fwrite(ix_blocks, sizeof(*ix_blocks), ix_nblocks, f);
+  offset = 0;
+  for (i = 0; i <= INDEX_NBUCKETS; i++)
+    {
+      fwrite(&offset, sizeof(offset), 1, f);
+      if (i < INDEX_NBUCKETS)
+	offset += ix_postings[i].len;
+    }
+  for (i = 0; i < INDEX_NBUCKETS; i++)
+    fwrite(ix_postings[i].data, 1, ix_postings[i].len, f);
+
+  if (ferror(f) | fclose(f) || rename(tmp, path) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+      unlink(tmp);
+      return 2;
+    }
+  return 0;
+}
+
+/* State for --index. */
+static int index_active;   /* The index is loaded and can skip blocks. */
+static const struct tre_agrep_index_file **index_files;
+static uint64_t index_nfiles;
+static const struct tre_agrep_index_block *index_blocks;
+static unsigned char *index_candidates; /* Per block, 1 if it may match. */
+static struct tre_agrep_range *index_ranges;
+static size_t index_ranges_size;
+static unsigned char *index_map;   /* The mapped index file. */
+static size_t index_map_size;
+
+/* Returns the largest number of edits a match can have, or -1 if there
+   is no limit. */
+static int
+index_max_edits(int max_cost)
+{
+  int min_cost = MIN(searcher.params.cost_ins,
+		     MIN(searcher.params.cost_del, searcher.params.cost_subst));
+
+  if (min_cost <= 0)
+    return -1;
+  return MIN(max_cost / min_cost, searcher.params.max_err);
+}
+
+/* Loads the index in `dir' and works out which blocks can contain a
+   match of `index_pattern' with at most `max_cost'.  If the index
+   cannot help, all files are searched in full as usual. */
+static void
+index_load(const char *dir, const char *delim_regexp, int comp_flags,
+	   int max_cost)
+{
+  const struct tre_agrep_index_header *hdr;
+  const unsigned char *p, *end;
+  const uint64_t *bucket_offsets;
+  const unsigned char *postings;
+  unsigned char *map;
+  uint32_t *hits, *weights, always = 0;
+  int k, threshold;
+  size_t m, i, pos, map_size;
+  struct stat st;
+  char *path;
+  int fd;
+
+  if (index_pattern == NULL || invert_match)
+    return;
+  k = index_max_edits(max_cost);
+  m = strlen(index_pattern);
+  if (k < 0 || m < INDEX_Q)
+    return;
+  threshold = (int)(m - INDEX_Q + 1) - k * (INDEX_Q + (int)MB_CUR_MAX - 1);
+  if (threshold <= 0)
+    return;
+
+  path = path_join(dir, INDEX_FILENAME);
+  fd = path ? open(path, O_RDONLY) : -1;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path ? path : dir,
+	      strerror(errno));
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+  map_size = st.st_size;
+  map = map_size >= sizeof(*hdr)
+    ? mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED)
+    goto bad;
+
+  /* Check the header, and find the tables. */
+  hdr = (const struct tre_agrep_index_header *)map;
+  end = map + map_size;
+  if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->version != INDEX_VERSION || hdr->byte_order != INDEX_BYTE_ORDER
+      || hdr->q != INDEX_Q || hdr->bucket_bits != INDEX_BUCKET_BITS)
+    goto bad;
+  p = map + sizeof(*hdr);
+  if ((size_t)(end - p) < INDEX_ALIGN(hdr->delim_len) + hdr->files_size)
+    goto bad;
+  if (hdr->delim_len != strlen(delim_regexp)
+      || memcmp(p, delim_regexp, hdr->delim_len) != 0)
+    {
+      fprintf(stderr, _("%s: %s: index was built with a different record "
+			"delimiter, not using it\n"), program_name, path);
+      munmap(map, map_size);
+      return;
+    }
+  p += INDEX_ALIGN(hdr->delim_len);
+  index_nfiles = hdr->nfiles;
+  index_files = xrealloc(NULL, (index_nfiles + 1) * sizeof(*index_files));
+  for (i = 0; i < index_nfiles; i++)
+    {
+      const struct tre_agrep_index_file *f
+	= (const struct tre_agrep_index_file *)p;
+      if ((size_t)(end - p) < sizeof(*f)
+	  || (size_t)(end - p) - sizeof(*f) < INDEX_ALIGN(f->path_len)
+	  || f->first_block + f->nblocks > hdr->nblocks)
+	goto bad;
+      index_files[i] = f;
+      p += sizeof(*f) + INDEX_ALIGN(f->path_len);
+    }
+  index_blocks = (const struct tre_agrep_index_block *)p;
+  if ((size_t)(end - p) / sizeof(*index_blocks) < hdr->nblocks)
+    goto bad;
+  p += hdr->nblocks * sizeof(*index_blocks);
+  bucket_offsets = (const uint64_t *)p;
+  if ((size_t)(end - p) < (INDEX_NBUCKETS + 1) * sizeof(uint64_t))
+    goto bad;
+  p += (INDEX_NBUCKETS + 1) * sizeof(uint64_t);
+  postings = p;
+  if ((uint64_t)(end - p) < hdr->postings_size
+      || bucket_offsets[INDEX_NBUCKETS] != hdr->postings_size)
+    goto bad;
+
+  /* Weigh each bucket by the number of pattern positions whose q-gram
+     falls into it.  With -i, q-grams with non-ASCII bytes may be folded
+     differently, so those positions are always counted as present. */
+  weights = calloc(INDEX_NBUCKETS, sizeof(*weights));
+  hits = calloc(hdr->nblocks + 1, sizeof(*hits));
+  index_candidates = malloc(hdr->nblocks + 1);
+  if (weights == NULL || hits == NULL || index_candidates == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  for (pos = 0; pos + INDEX_Q <= m; pos++)
+    {
+      const unsigned char *g = (const unsigned char *)index_pattern + pos;
+      if ((comp_flags & REG_ICASE) && (g[0] | g[1] | g[2]) & 0x80)
+	always++;
+      else
+	weights[index_bucket(g)]++;
+    }
+
+  /* Count, for each block, the pattern q-grams it contains. */
+  for (i = 0; i < INDEX_NBUCKETS; i++)
+    {
+      const unsigned char *q, *qend;
+      uint64_t block = 0;
+
+      if (weights[i] == 0)
+	continue;
+      q = postings + bucket_offsets[i];
+      qend = postings + MIN(bucket_offsets[i + 1], hdr->postings_size);
+      while (q < qend)
+	{
+	  uint64_t delta = 0;
+	  int shift = 0;
+	  while (q < qend && (*q & 0x80) && shift < 63)
+	    {
+	      delta |= (uint64_t)(*q++ & 0x7f) << shift;
+	      shift += 7;
+	    }
+	  if (q == qend)
+	    break;
+	  delta |= (uint64_t)*q++ << shift;
+	  block += delta;
+	  if (block == 0 || block > hdr->nblocks)
+	    break;
+	  hits[block - 1] += weights[i];
+	}
+    }
+  for (i = 0; i < hdr->nblocks; i++)
+    index_candidates[i] = hits[i] + always >= (uint32_t)threshold;
+  free(weights);
+  free(hits);
+  index_map = map;
+  index_map_size = map_size;
+  index_active = 1;
+  return;
+
+ bad:
+  fprintf(stderr, _("%s: %s: not a valid index, not using it\n"),
+	  program_name, path);
+  if (map != MAP_FAILED)
+    munmap(map, map_size);
+}
+
+/* Releases the index loaded by index_load(). */
+static void
+index_unload(void)
+{
+  if (index_map != NULL)
+    munmap(index_map, index_map_size);
+  index_map = NULL;
+  index_map_size = 0;
+  free(index_files);
+  index_files = NULL;
+  index_nfiles = 0;
+  index_blocks = NULL;
+  free(index_candidates);
+  index_candidates = NULL;
+  ranges = NULL;
+  nranges = 0;
+  index_active = 0;
+}
+
+static int
+index_file_compare(const void *key, const void *entry)
+{
+  const struct tre_agrep_index_file *f
+    = *(const struct tre_agrep_index_file *const *)entry;
+  const char *path = (const char *)(f + 1);
+  int cmp = strncmp(key, path, f->path_len);
+
+  if (cmp == 0 && ((const char *)key)[f->path_len] != '\0')
+    cmp = 1;
+  return cmp;
+}
+
+/* If `filename' is in the index and has not changed since the index was
+   built, makes the reader read only the blocks that can match. */
+static void
+index_select_ranges(int fd, const char *filename)
+{
+  const struct tre_agrep_index_file *const *fp;
+  const struct tre_agrep_index_file *f;
+  struct stat st;
+  uint64_t i;
+  size_t n = 0;
+
+  fp = bsearch(filename, index_files, index_nfiles, sizeof(*index_files),
+	       index_file_compare);
+  if (fp == NULL)
+    return;
+  f = *fp;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+      || f->dev != (uint64_t)st.st_dev || f->ino != (uint64_t)st.st_ino
+      || f->size != (uint64_t)st.st_size
+      || f->mtime_sec != st.st_mtim.tv_sec
+      || f->mtime_nsec != st.st_mtim.tv_nsec)
+    return;
+
+  /* Merge runs of adjacent candidate blocks into one range. */
+  for (i = f->first_block; i < f->first_block + f->nblocks; i++)
+    {
+      const struct tre_agrep_index_block *b = &index_blocks[i];
+      if (!index_candidates[i])
+	continue;
+      if (n > 0 && index_ranges[n - 1].offset + index_ranges[n - 1].length
+	  == (off_t)b->offset)
+	{
+	  index_ranges[n - 1].length += b->length;
+	  continue;
+	}
+      if (n == index_ranges_size)
+	{
+	  index_ranges_size = index_ranges_size ? index_ranges_size * 2 : 64;
+	  index_ranges = xrealloc(index_ranges,
+				  index_ranges_size * sizeof(*index_ranges));
+	}
+      index_ranges[n].offset = b->offset;
+      index_ranges[n].length = b->length;
+      index_ranges[n].recnum = b->recnum;
+      n++;
+    }
+
+  ranges = index_ranges;
+  nranges = n;
+  next_range = 0;
+  if (!tre_agrep_next_range(fd, filename))
+    reader.at_eof = 1;
+}
+
+/* --checkpoint.  The state file records, for each file searched, where
+   the last complete record ended, so that the next run with the same
+   state file searches only what was appended since.  The file is text:
+
+     agrep-checkpoint 2
+     delimiter HEX
+     DEV INO SIZE OFFSET RECNUM PRINT PATH
+
+   where HEX is the -d pattern in hexadecimal, and there is one line per
+   file.  PRINT is a hash of the bytes just before OFFSET, in hexadecimal.
+   A file whose device or inode changed, that is smaller than SIZE, or
+   whose bytes before OFFSET changed was replaced or truncated (perhaps
+   in place, and grown again since) and is searched from the start.
+
+   A lock file next to the state file is held for the whole run, so that
+   concurrent runs take turns, and the state file is replaced with
+   rename(), so that a crashed run leaves the old state. */
+
+struct tre_agrep_checkpoint {
+  char *path;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;	   /* Size of the file when last searched. */
+  uint64_t offset;	   /* End of the last complete record. */
+  uint64_t recnum;	   /* Number of records before `offset'. */
+  uint64_t print;	   /* checkpoint_print() at `offset'. */
+  int updated;		   /* The fields above are from this run. */
+};
+
+static struct tre_agrep_checkpoint *ck_entries;
+static size_t ck_nentries;
+static size_t ck_nloaded;  /* Entries read from the state file, sorted. */
+static size_t ck_size;
+static int ck_lock_fd = -1;
+static const char *ck_delim;
+
+/* Bytes before the offset that checkpoint_print() hashes. */
+#define CHECKPOINT_PRINT_SIZE 4096
+
+/* Returns a hash of the bytes of file `fd' just before `offset', which
+   tells whether the file still holds what was searched there. */
+static uint64_t
+checkpoint_print(int fd, off_t offset)
+{
+  unsigned char buf[CHECKPOINT_PRINT_SIZE];
+  uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+  off_t start = offset > CHECKPOINT_PRINT_SIZE
+    ? offset - CHECKPOINT_PRINT_SIZE : 0;
+  ssize_t r, i;
+
+  r = pread(fd, buf, offset - start, start);
+  for (i = 0; i < r; i++)
+    h = (h ^ buf[i]) * 0x100000001b3ULL;
+  /* A short read hashes differently from a full one. */
+  return r == offset - start ? h : ~h;
+}
+
+static int
+checkpoint_compare(const void *a, const void *b)
+{
+  return strcmp(((const struct tre_agrep_checkpoint *)a)->path,
+		((const struct tre_agrep_checkpoint *)b)->path);
+}
+
+static void
+checkpoint_hex(FILE *f, const char *str)
+{
+  for (; *str != '\0'; str++)
+    fprintf(f, "%02x", (unsigned char)*str);
+}
+
+static struct tre_agrep_checkpoint *
+checkpoint_add(const char *path)
+{
+  struct tre_agrep_checkpoint *ck;
+
+  if (ck_nentries == ck_size)
+    {
+      ck_size = ck_size ? ck_size * 2 : 64;
+      ck_entries = xrealloc(ck_entries, ck_size * sizeof(*ck_entries));
+    }
+  ck = &ck_entries[ck_nentries++];
+  memset(ck, 0, sizeof(*ck));
+  ck->path = strdup(path);
+  if (ck->path == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  return ck;
+}
+
+/* Returns the entry for `path', or NULL.  With `loaded', only entries from
+   the state file are considered. */
+static struct tre_agrep_checkpoint *
+checkpoint_find(const char *path, int loaded)
+{
+  struct tre_agrep_checkpoint key, *ck;
+  size_t i;
+
+  key.path = (char *)path;
+  ck = bsearch(&key, ck_entries, ck_nloaded, sizeof(*ck_entries),
+	       checkpoint_compare);
+  if (ck != NULL || loaded)
+    return ck;
+  for (i = ck_nloaded; i < ck_nentries; i++)
+    if (strcmp(ck_entries[i].path, path) == 0)
+      return &ck_entries[i];
+  return NULL;
+}
+
+/* Locks and reads the state file `path'.  Returns 0, or 2 on errors. */
+static int
+checkpoint_load(const char *path, const char *delim_regexp)
+{
+  char *lock_path, *line = NULL, *hex = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  FILE *f;
+
+  ck_delim = delim_regexp;
+  lock_path = malloc(strlen(path) + 6);
+  if (lock_path == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      return 2;
+    }
+  sprintf(lock_path, "%s.lock", path);
+  ck_lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (ck_lock_fd < 0 || flock(ck_lock_fd, LOCK_EX) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, lock_path,
+	      strerror(errno));
+      free(lock_path);
+      return 2;
+    }
+  free(lock_path);
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    {
+      if (errno == ENOENT)
+	return 0;	     /* First run. */
+      fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+      return 2;
+    }
+
+  /* A state file made with another delimiter has offsets of other
+     records; start over. */
+  hex = malloc(2 * strlen(delim_regexp) + 1);
+  if (hex == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  for (len = 0; delim_regexp[len] != '\0'; len++)
+    sprintf(hex + 2 * len, "%02x", (unsigned char)delim_regexp[len]);
+  hex[2 * len] = '\0';
+  if (getline(&line, &line_size, f) < 0
+      || strcmp(line, "agrep-checkpoint 2\n") != 0
+      || getline(&line, &line_size, f) < 0
+      || strncmp(line, "delimiter ", 10) != 0
+      || strncmp(line + 10, hex, strlen(hex)) != 0
+      || line[10 + strlen(hex)] != '\n')
+    {
+      fprintf(stderr, _("%s: %s: not a state file for this delimiter, "
+			"searching all files in full\n"), program_name, path);
+      goto out;
+    }
+
+  while ((len = getline(&line, &line_size, f)) > 0)
+    {
+      unsigned long long dev, ino, size, offset, recnum, print;
+      struct tre_agrep_checkpoint *ck;
+      int n = 0;
+
+      if (line[len - 1] == '\n')
+	line[--len] = '\0';
+      /* The name is everything after the single space that follows
+	 the numbers, leading spaces included. */
+      if (sscanf(line, "%llu %llu %llu %llu %llu %llx%n", &dev, &ino, &size,
+		 &offset, &recnum, &print, &n) != 6 || n == 0 || line[n] != ' '
+	  || line[n + 1] == '\0')
+	continue;
+      ck = checkpoint_add(line + n + 1);
+      ck->dev = dev;
+      ck->ino = ino;
+      ck->size = size;
+      ck->offset = offset;
+      ck->recnum = recnum;
+      ck->print = print;
+    }
+  qsort(ck_entries, ck_nentries, sizeof(*ck_entries), checkpoint_compare);
+  ck_nloaded = ck_nentries;
+
+ out:
+  free(line);
+  free(hex);
+  fclose(f);
+  return 0;
+}
+
+/* If file `fd' has a checkpoint, and it is still the same file, moves to
+   the end of its last complete record and returns the number of records
+   before it.  Returns -1 to search the file from the start. */
+static long long
+checkpoint_seek(int fd, const char *filename)
+{
+  const struct tre_agrep_checkpoint *ck = checkpoint_find(filename, 1);
+  struct stat st;
+
+  if (ck == NULL || fstat(fd, &st) != 0
+      || ck->dev != (uint64_t)st.st_dev || ck->ino != (uint64_t)st.st_ino
+      || (uint64_t)st.st_size < ck->size || ck->offset > ck->size
+      || checkpoint_print(fd, ck->offset) != ck->print
+      || lseek(fd, ck->offset, SEEK_SET) == (off_t)-1)
+    return -1;
+  return ck->recnum;
+}
+
+/* Records that file `fd' was searched up to `offset', past `recnum'
+   records. */
+static void
+checkpoint_update(int fd, const char *filename, off_t offset,
+		  unsigned long long recnum)
+{
+  struct tre_agrep_checkpoint *ck;
+  struct stat st;
+
+  if (strchr(filename, '\n') != NULL || fstat(fd, &st) != 0
+      || !S_ISREG(st.st_mode))
+    return;
+  ck = checkpoint_find(filename, 0);
+  if (ck == NULL)
+    ck = checkpoint_add(filename);
+  ck->dev = st.st_dev;
+  ck->ino = st.st_ino;
+  ck->size = MAX((uint64_t)st.st_size, (uint64_t)offset);
+  ck->offset = offset;
+  ck->recnum = recnum;
+  ck->print = checkpoint_print(fd, offset);
+  ck->updated = 1;
+}
+
+/* Writes the state file and releases the lock.  Returns 0, or 2 on
+   errors. */
+static int
+checkpoint_save(void)
+{
+  char *tmp;
+  size_t i;
+  FILE *f;
+  int status = 0;
+
+  if (ck_lock_fd < 0)
+    return 0;
+  tmp = malloc(strlen(checkpoint_path) + 32);
+  if (tmp == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      return 2;
+    }
+  sprintf(tmp, "%s.%ld.tmp", checkpoint_path, (long)getpid());
+  f = fopen(tmp, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, tmp, strerror(errno));
+      free(tmp);
+      return 2;
+    }
+  fputs("agrep-checkpoint 2\ndelimiter ", f);
+  checkpoint_hex(f, ck_delim);
+  fputc('\n', f);
+  for (i = 0; i < ck_nentries; i++)
+    {
+      const struct tre_agrep_checkpoint *ck = &ck_entries[i];
+      fprintf(f, "%llu %llu %llu %llu %llu %016llx %s\n",
+	      (unsigned long long)ck->dev, (unsigned long long)ck->ino,
+	      (unsigned long long)ck->size, (unsigned long long)ck->offset,
+	      (unsigned long long)ck->recnum, (unsigned long long)ck->print,
+	      ck->path);
+    }
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0 || ferror(f)
+      || fclose(f) != 0 || rename(tmp, checkpoint_path) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, checkpoint_path,
+	      strerror(errno));
+      unlink(tmp);
+      status = 2;
+    }
+  free(tmp);
+  close(ck_lock_fd);
+  ck_lock_fd = -1;
+  return status;
+}
+
+/* Forgets all checkpoints (for --serve), releasing the lock if it is
+   still held. */
+static void
+checkpoint_reset(void)
+{
+  size_t i;
+
+  for (i = 0; i < ck_nentries; i++)
+    free(ck_entries[i].path);
+  free(ck_entries);
+  ck_entries = NULL;
+  ck_nentries = ck_nloaded = ck_size = 0;
+  if (ck_lock_fd >= 0)
+    close(ck_lock_fd);
+  ck_lock_fd = -1;
+}
+
+/* --result-cache.  For each file searched, the records selected by a
+   query are remembered in a small file in the cache directory, so that
+   the same query over the same, unchanged file only reads and matches
+   those records again, through the same ranges as --index.  Each cache
+   file is named after a hash of the query and the file identity, and is
+   text:
+
+     agrep-result-cache 1
+     key QUERY
+     file DEV INO SIZE MTIME_SEC MTIME_NSEC
+     OFFSET PREV END RECNUM
+
+   with one line per selected record: its offset, the offset of the
+   record before it (read again without -M, so that the delimiter before
+   the record is printed), the end of its delimiter and its number.
+   Costs are not stored: the records are matched again when read.  QUERY
+   describes the pattern, the -i, -k and -w flags, the costs and the
+   delimiter.  A file is used only if both lines match exactly.
+
+   A hit touches the cache file, and at the end of a run that added to
+   the cache, the least recently used files are removed until the cache
+   fits in --result-cache-size. */
+
+#define RESULT_CACHE_SUFFIX ".rc"
+
+struct tre_agrep_rc_hit {
+  uint64_t offset;
+  uint64_t prev;
+  uint64_t end;
+  uint64_t recnum;
+};
+
+static const char *result_cache_dir; /* --result-cache directory. */
+static unsigned long long result_cache_size = 256ULL << 20; /* Budget. */
+static char *rc_key;	     /* QUERY, NULL if the cache is not used. */
+static int rc_recording;     /* Remember the selected records of this file. */
+static int rc_written;	     /* Files were added to the cache in this run. */
+static struct stat rc_st;    /* The file being recorded. */
+static off_t rc_cur = -1;    /* Offset of the current record, */
+static off_t rc_end = -1;    /* and end of its delimiter. */
+static struct tre_agrep_rc_hit *rc_hits;
+static size_t rc_nhits, rc_hits_size;
+static struct tre_agrep_range *rc_ranges;
+static size_t rc_ranges_size;
+
+/* Sets `rc_key' for the current query. */
+static void
+result_cache_init(const char *regexp, int comp_flags, int literal_string,
+		  int word_regexp, const char *delim_regexp)
+{
+  const regaparams_t *p = &searcher.params;
+  size_t len;
+  FILE *f = open_memstream(&rc_key, &len);
+
+  if (f == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  fputs("pattern ", f);
+  checkpoint_hex(f, regexp);
+  fprintf(f, " cflags %d literal %d word %d costs %d %d %d %d %d %d %d %d"
+	  " delimiter ", comp_flags, literal_string, word_regexp,
+	  p->cost_ins, p->cost_del, p->cost_subst, p->max_cost,
+	  p->max_ins, p->max_del, p->max_subst, p->max_err);
+  checkpoint_hex(f, delim_regexp);
+  if (fclose(f) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+}
+
+/* Writes the `file' line for `st' to `buf', which has room for 128
+   bytes. */
+static void
+result_cache_identity(char *buf, const struct stat *st)
+{
+  sprintf(buf, "file %llu %llu %llu %lld %ld",
+	  (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+	  (unsigned long long)st->st_size, (long long)st->st_mtim.tv_sec,
+	  (long)st->st_mtim.tv_nsec);
+}
+
+/* Returns the malloc()ed name of the cache file for the current query
+   over the file with identity `id'. */
+static char *
+result_cache_path(const char *id)
+{
+  uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+  const char *s;
+  char *path;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    for (s = i == 0 ? rc_key : id; *s != '\0'; s++)
+      h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  path = malloc(strlen(result_cache_dir) + 32);
+  if (path == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  sprintf(path, "%s/%016llx" RESULT_CACHE_SUFFIX, result_cache_dir,
+	  (unsigned long long)h);
+  return path;
+}
+
+/* Reads one line of `f' into `*line' and checks that it is `expect'. */
+static int
+result_cache_line_is(FILE *f, char **line, size_t *size, const char *expect)
+{
+  ssize_t n = getline(line, size, f);
+
+  return n > 0 && (*line)[n - 1] == '\n'
+    && (size_t)n - 1 == strlen(expect)
+    && memcmp(*line, expect, n - 1) == 0;
+}
+
+/* Looks up file `fd' in the cache.  On a hit, makes the reader read only
+   the selected records and returns 1.  Otherwise returns 0, and the
+   selected records are recorded for result_cache_store(). */
+static int
+result_cache_lookup(int fd, const char *filename)
+{
+  char id[128], *path, *line = NULL;
+  size_t size = 0, n = 0;
+  FILE *f;
+  int hit = 0;
+
+  if (fstat(fd, &rc_st) != 0 || !S_ISREG(rc_st.st_mode))
+    return 0;
+  result_cache_identity(id, &rc_st);
+  path = result_cache_path(id);
+  f = fopen(path, "r");
+  if (f != NULL && result_cache_line_is(f, &line, &size,
+					"agrep-result-cache 1"))
+    {
+      char *key = malloc(strlen(rc_key) + 8);
+
+      if (key == NULL)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      sprintf(key, "key %s", rc_key);
+      hit = result_cache_line_is(f, &line, &size, key)
+	&& result_cache_line_is(f, &line, &size, id);
+      free(key);
+    }
+
+  while (hit && getline(&line, &size, f) > 0)
+    {
+      unsigned long long offset, prev, end, recnum;
+      off_t start;
+
+      if (sscanf(line, "%llu %llu %llu %llu", &offset, &prev, &end,
+		 &recnum) != 4 || prev > offset || end < offset
+	  || recnum == 0)
+	{
+	  hit = 0;
+	  break;
+	}
+      /* Without -M, the delimiter before the record is printed, so
+	 start at the record before it. */
+      start = delim_after ? offset : prev;
+      if (!delim_after && prev < offset)
+	recnum--;
+      if (n > 0 && start <= rc_ranges[n - 1].offset + rc_ranges[n - 1].length)
+	{
+	  rc_ranges[n - 1].length = MAX(rc_ranges[n - 1].length,
+					(off_t)end - rc_ranges[n - 1].offset);
+	  continue;
+	}
+      if (n == rc_ranges_size)
+	{
+	  rc_ranges_size = rc_ranges_size ? rc_ranges_size * 2 : 64;
+	  rc_ranges = xrealloc(rc_ranges, rc_ranges_size * sizeof(*rc_ranges));
+	}
+      rc_ranges[n].offset = start;
+      rc_ranges[n].length = end - start;
+      rc_ranges[n].recnum = recnum;
+      n++;
+    }
+  free(line);
+
+  if (hit)
+    {
+      futimens(fileno(f), NULL); /* Most recently used. */
+      ranges = rc_ranges;
+      nranges = n;
+      next_range = 0;
+      if (!tre_agrep_next_range(fd, filename))
+	reader.at_eof = 1;
+    }
+  else
+    {
+      rc_recording = 1;
+      rc_nhits = 0;
+      rc_cur = rc_end = -1;
+    }
+  if (f != NULL)
+    fclose(f);
+  free(path);
+  return hit;
+}
+
+/* Notes that the current record is being looked at, and, if `selected',
+   that it was selected. */
+static void
+result_cache_record(int selected)
+{
+  struct tre_agrep_rc_hit *h;
+  off_t offset = agrep_reader_offset(&reader);
+  /* The record before, if it was read too (not with --index). */
+  off_t prev = offset == rc_end ? rc_cur : offset;
+
+  rc_cur = offset;
+  rc_end = offset + reader.record_len + reader.next_delim_len;
+  if (!selected)
+    return;
+  if (rc_nhits == rc_hits_size)
+    {
+      rc_hits_size = rc_hits_size ? rc_hits_size * 2 : 64;
+      rc_hits = xrealloc(rc_hits, rc_hits_size * sizeof(*rc_hits));
+    }
+  h = &rc_hits[rc_nhits++];
+  h->offset = offset;
+  h->prev = prev;
+  h->end = rc_end;
+  h->recnum = reader.recnum;
+}
+
+/* Writes the records selected in the file just searched to the cache.
+   Errors are not fatal: the cache is just not updated. */
+static void
+result_cache_store(void)
+{
+  char id[128], *path, *tmp;
+  size_t i;
+  FILE *f;
+
+  rc_recording = 0;
+  if (mkdir(result_cache_dir, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, result_cache_dir,
+	      strerror(errno));
+      return;
+    }
+  result_cache_identity(id, &rc_st);
+  path = result_cache_path(id);
+  tmp = malloc(strlen(path) + 32);
+  if (tmp == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+  f = fopen(tmp, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, tmp, strerror(errno));
+      free(tmp);
+      free(path);
+      return;
+    }
+  fprintf(f, "agrep-result-cache 1\nkey %s\n%s\n", rc_key, id);
+  for (i = 0; i < rc_nhits; i++)
+    fprintf(f, "%llu %llu %llu %llu\n",
+	    (unsigned long long)rc_hits[i].offset,
+	    (unsigned long long)rc_hits[i].prev,
+	    (unsigned long long)rc_hits[i].end,
+	    (unsigned long long)rc_hits[i].recnum);
+  if (ferror(f) | fclose(f) || rename(tmp, path) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+      unlink(tmp);
+    }
+  else
+    rc_written = 1;
+  free(tmp);
+  free(path);
+}
+
+struct tre_agrep_rc_file {
+  char *name;
+  off_t size;
+  struct timespec mtime;
+};
+
+static int
+result_cache_compare(const void *a, const void *b)
+{
+  const struct tre_agrep_rc_file *x = a, *y = b;
+
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* Removes the least recently used cache files until the cache fits in
+   `result_cache_size'. */
+static void
+result_cache_evict(void)
+{
+  struct tre_agrep_rc_file *files = NULL;
+  size_t nfiles = 0, files_size = 0, i;
+  unsigned long long total = 0;
+  struct dirent *de;
+  DIR *dir;
+
+  if (!rc_written)
+    return;
+  rc_written = 0;
+  dir = opendir(result_cache_dir);
+  if (dir == NULL)
+    return;
+  while ((de = readdir(dir)) != NULL)
+    {
+      size_t len = strlen(de->d_name);
+      struct stat st;
+
+      if (len != 16 + strlen(RESULT_CACHE_SUFFIX)
+	  || strcmp(de->d_name + 16, RESULT_CACHE_SUFFIX) != 0
+	  || fstatat(dirfd(dir), de->d_name, &st, 0) != 0)
+	continue;
+      if (nfiles == files_size)
+	{
+	  files_size = files_size ? files_size * 2 : 64;
+	  files = xrealloc(files, files_size * sizeof(*files));
+	}
+      files[nfiles].name = strdup(de->d_name);
+      if (files[nfiles].name == NULL)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      files[nfiles].size = st.st_size;
+      files[nfiles].mtime = st.st_mtim;
+      total += st.st_size;
+      nfiles++;
+    }
+
+  qsort(files, nfiles, sizeof(*files), result_cache_compare);
+  for (i = 0; i < nfiles; i++)
+    {
+      if (total > result_cache_size
+	  && unlinkat(dirfd(dir), files[i].name, 0) == 0)
+	total -= files[i].size;
+      free(files[i].name);
+    }
+  free(files);
+  closedir(dir);
+}
+
+/* -v with newline delimited records and plain output (see `bulk_invert'
+   in main()).  Filtering out a few lines is the common case, so instead
+   of matching and writing each record, the pattern is searched for in
+   whole blocks of lines, and the runs of lines between the matching ones
+   are written with one fwrite() each, straight from the read buffer.
+   Lines are counted, for -c and -n, with agrep_count_delims(). */
+
+static int bulk_invert;	     /* Search and output -v by blocks. */
+static regex_t invert_preg;  /* PATTERN with REG_NEWLINE, for blocks. */
+static const char *invert_counted; /* Lines before this are counted */
+static unsigned long long invert_recnum; /* in this. */
+
+/* Finds the first match in `len' bytes of whole lines at `p' and returns
+   its span in `so' and `eo'.  Returns 1, or 0 if there is none. */
+static int
+invert_block_search(const char *p, size_t len, size_t *so, size_t *eo)
+{
+  regamatch_t match;
+  regmatch_t pmatch[1];
+  int errcode;
+
+  if (searcher.literal != NULL)
+    {
+      const char *m = memmem(p, len, searcher.literal, searcher.literal_len);
+
+      if (m == NULL)
+	return 0;
+      *so = m - p;
+      *eo = *so + searcher.literal_len;
+      return 1;
+    }
+
+  memset(&match, 0, sizeof(match));
+  match.pmatch = pmatch;
+  match.nmatch = 1;
+  errcode = tre_reganexec(&invert_preg, p, len, &match, searcher.params, 0);
+  STATS_ADD(reganexec_calls, 1);
+  if (errcode == REG_ESPACE)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  if (errcode != REG_OK)
+    return 0;
+  *so = pmatch[0].rm_so;
+  *eo = pmatch[0].rm_eo;
+  return 1;
+}
+
+/* Returns the number of the line that starts at `p'. */
+static unsigned long long
+invert_line_number(const char *p)
+{
+  invert_recnum += agrep_count_delims(invert_counted, p - invert_counted,
+				      "\n", 1);
+  invert_counted = p;
+  return invert_recnum + 1;
+}
+
+/* Writes the run of selected lines from `start' to `end', and adds their
+   number to `*count'.  Returns 0, or 1 if the file turned out to be
+   binary and the search is over. */
+static int
+invert_output(const char *filename, const char *start, const char *end,
+	      unsigned long long *count)
+{
+  unsigned long long first;
+
+  if (start == end)
+    return 0;
+  have_matches = 1;
+  if (file_is_binary && !count_matches)
+    {
+      print_binary_match(stdout, filename);
+      (*count)++;
+      return 1;
+    }
+  /* The last line may have no newline. */
+  first = invert_line_number(start);
+  *count += invert_line_number(end) - first + (end[-1] != '\n');
+  if (count_matches)
+    return 0;
+  if (!print_recnum)
+    {
+      fwrite(start, 1, end - start, stdout);
+      return 0;
+    }
+  while (start < end)
+    {
+      const char *nl = memchr(start, '\n', end - start);
+      const char *next = nl != NULL ? nl + 1 : end;
+
+      printf("%llu:", first++);
+      fwrite(start, 1, next - start, stdout);
+      start = next;
+    }
+  return 0;
+}
+
+/* Searches the reader's input like tre_agrep_search_records(), by
+   blocks.  Returns the number of selected lines. */
+static unsigned long long
+tre_agrep_search_invert(const char *filename)
+{
+  unsigned long long count = 0;
+  char *block;
+  size_t len;
+  int r;
+
+  while (!quit)
+    {
+      char *p, *run, *end;
+
+      invert_recnum = reader.recnum;
+      r = agrep_reader_block(&reader, &block, &len);
+      if (r == 0)
+	break;
+      p = run = block;
+      invert_counted = block;
+      end = block + len;
+
+      if (r < 0)
+	{
+	  if (errno == ENOMEM)
+	    {
+	      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	      exit(2);
+	    }
+	  fprintf(stderr, "%s: ", program_name);
+	  fprintf(stderr, _("Error reading from %s: %s\n"), filename,
+		  strerror(errno));
+	  break;
+	}
+      if (file_is_binary && binary_files == BINARY_WITHOUT_MATCH)
+	break;
+
+      while (p < end)
+	{
+	  size_t so, eo;
+	  char *line, *last;
+
+	  if (!invert_block_search(p, end - p, &so, &eo))
+	    break;
+
+	  /* Check the lines the match touches one by one: a match in a
+	     block may run across lines, which no record would match.  In
+	     exact matching, the first match in the block cannot start
+	     after the end of the first matching line, so the lines before
+	     the one it starts in do not match.  Approximate matches give
+	     no such guarantee, so all the lines up to it are checked. */
+	  last = memchr(p + (eo > so ? eo - 1 : so), '\n',
+			end - p - (eo > so ? eo - 1 : so));
+	  last = last != NULL ? last + 1 : end;
+	  if (searcher.params.max_cost == 0)
+	    {
+	      line = memrchr(p, '\n', so);
+	      line = line != NULL ? line + 1 : p;
+	    }
+	  else
+	    line = p;
+
+	  while (line < last)
+	    {
+	      struct agrep_match m;
+	      char *nl = memchr(line, '\n', last - line);
+	      char *next = nl != NULL ? nl + 1 : last;
+	      int selected = agrep_searcher_match(&searcher, line,
+						  (nl != NULL ? nl : last)
+						  - line, &m);
+
+	      STATS_ADD(reganexec_calls, 1);
+	      if (selected < 0)
+		{
+		  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+		  exit(2);
+		}
+	      if (!selected)
+		{
+		  /* A matching line ends the run. */
+		  if (invert_output(filename, run, line, &count))
+		    return count;
+		  run = next;
+		}
+	      line = next;
+	    }
+	  p = last;
+	}
+      if (invert_output(filename, run, end, &count))
+	return count;
+    }
+  return count;
+}
+
+/* Goes through the records of `fd' and outputs the matching ones, or the
+   non-matching ones if `invert_match' is true.  Returns the number of
+   selected records. */
+static unsigned long long
+tre_agrep_search_records(int fd, const char *filename)
+{
+  unsigned long long count = 0;
+
+  if (bulk_invert)
+    return tre_agrep_search_invert(filename);
+
+  while (!tre_agrep_get_next_record(fd, filename))
+    {
+      struct agrep_match m;
+      char *record = reader.record;
+      size_t record_len = reader.record_len;
+      int selected;
+      ssize_t so, eo;
+      unsigned long long t0 = 0;
+
+      /* With --checkpoint, a last record with no delimiter after it may
+	 still be being written; it is left for the next run. */
+      if (checkpointing && reader.at_eof)
+	break;
+
+      /* The first block read showed that this is a binary file, don't
+	 spend any time matching it. */
+      if (file_is_binary && binary_files == BINARY_WITHOUT_MATCH)
+	break;
+
+      if (stats_mode)
+	stats_record(record_len);
+      if (best_match)
+	searcher.params.max_cost = best_cost;
+
+      /* Stop searching for better matches if an exact match is found. */
+      if (best_match == 1 && best_cost == 0)
+	break;
+
+      /* See if the record matches. */
+      STATS_START(t0);
+      selected = agrep_searcher_match(&searcher, record, record_len, &m);
+      STATS_STOP(t0, match_ns);
+      STATS_ADD(reganexec_calls, 1);
+      if (selected < 0)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      if (rc_recording)
+	result_cache_record(selected);
+      if (stats_mode && m.matched)
+	stats_cost(m.cost);
+      so = m.so;
+      eo = m.eo;
+
+
+#ifdef SHAW_DEBUG
+      if (opt_debug) {
+          if (str_in_mem_region(record, record_len, "Title: Beginning Scala") != NULL) {
+              fprintf(stderr, "Got Title: Beginning Scala\n");
+              fprintf(stderr, "    matched=%d\n", m.matched);
+          }
+
+          if (!invert_match && str_in_mem_region(record, record_len, "Title: Beginning Scala") != NULL && !m.matched) {
+              fprintf(stderr, "Should have matched.\n");
+          }
+      }
+#endif
+
+      if (selected)
+	{
+
+#ifdef SHAW_DEBUG
+          if (opt_debug) {
+              fprintf(stderr, "Found match.\n");
+              fprintf(stderr, "    best_match=%d\n", best_match);
+          }
+#endif
+
+	  STATS_ADD(matches, 1);
+	  if (be_silent)
+	    {
+	      /* One match decides the exit status, stop right here. */
+	      have_matches = 1;
+	      quit = 1;
+	      break;
+	    }
+ 
+	  count++;
+	  have_matches = 1;
+	  if (best_match)
+	    {
+	      if (best_match == 1)
+		{
+		  /* First best match pass. */
+		  if (m.cost < best_cost)
+		    best_cost = m.cost;
+		  continue;
+		}
+	      /* Second best match pass. */
+	      if (m.cost > best_cost)
+		continue;
+	    }
+
+	  STATS_START(t0);
+	  if (list_files)
+	    {
+	      printf("%s\n", filename);
+	      STATS_STOP(t0, output_ns);
+	      break;
+	    }
+	  else if (output_format != OUTPUT_TEXT)
+	    output_record(filename, record, record_len, &m);
+	  else if (!count_matches)
+	    {
+	      if (file_is_binary)
+		{
+		  /* Don't dump binary data on the terminal, and don't
+		     scan the rest of the file: one match is enough. */
+		  print_binary_match(stdout, filename);
+		  STATS_STOP(t0, output_ns);
+		  break;
+		}
+
+          if (color_option && !invert_match) {
+
+              /*
+               * Look for more than one match.
+               * Instead of printing the trailing context after the first match,
+               * continue looking for more matches.
+               *
+               */
+
+              char *rec;
+              size_t len;
+              size_t col;
+              size_t shift;
+
+              print_prefix(stdout, filename, &reader, &m);
+              /* Print the delimiter before or after the record, too. */
+              shift = print_span(&reader, &record, &record_len);
+              so += shift;
+              eo += shift;
+
+              rec = record;
+              len = record_len;
+              col = 0;
+
+              while (true) {
+                  // Print leading context, before the matching text.
+                  print_record_indent(stdout, rec, so, &col);
+
+                  // Print the matching text itself, in color.
+                  printf("\33[%sm", highlight);
+                  print_record_indent(stdout, rec + so, eo - so, &col);
+                  fputs("\33[00m", stdout);
+
+                  /*
+                   * Advance to after the first match.
+                   * Test if there are any more matches.
+                   * If so, print them in color as well.
+                   * If not, then print the trailing context, and we are done.
+                   */
+
+                  rec += eo;
+                  len -= so;
+                  len -= eo - so;
+                  if (len == 0) {
+                      break;
+                  }
+                  // The match is match time, not output time.
+                  STATS_STOP(t0, output_ns);
+                  STATS_START(t0);
+                  agrep_searcher_match(&searcher, rec, len, &m);
+                  STATS_STOP(t0, match_ns);
+                  STATS_ADD(reganexec_calls, 1);
+                  STATS_START(t0);
+                  if (!m.matched) {
+                      print_record_indent(stdout, rec, len, &col);
+                      break;
+                  }
+                  so = m.so;
+                  eo = m.eo;
+              }
+          }
+	      else
+		{
+#ifdef SHAW_DEBUG
+              if (opt_debug) {
+                  fprintf(stderr, "    record_len=%zu\n", record_len);
+		          fprintf(stderr,
+                    "    fwrite(record=%p=buf+%zu, record_len=%zu, 1, stdout)\n",
+                    record, record - reader.buf, record_len);
+              }
+#endif
+	      print_record(stdout, filename, &reader, &m);
+		}
+	      /* A partial last record flushed by --follow has no delimiter
+		 after it; end the line so the next match starts on its own. */
+	      if (follow_current != NULL && reader.next_delim_len == 0
+		  && record_len > 0 && record[record_len - 1] != '\n')
+		putchar('\n');
+	    }
+	  /* With --follow, records are output as soon as they are found. */
+	  if (follow_current != NULL)
+	    {
+	      out_flush();
+	      fflush(stdout);
+	    }
+	  STATS_STOP(t0, output_ns);
+	}
+    }
+  out_flush();
+  return count;
+}
+
+/* Searches the already open file `fd', which is reported as `filename'
+   in the output. */
+static int
+tre_agrep_handle_fd(int fd, const char *filename)
+{
+  unsigned long long count = 0;
+  struct stat st;
+#ifdef HAVE_DECOMPRESS
+  struct tre_agrep_decompress dec;
+  int decompressing;
+#endif /* HAVE_DECOMPRESS */
+
+  /* Allocate the initial buffer. */
+  if (reader.buf == NULL && agrep_reader_init(&reader, &searcher) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+
+  /* Reset read buffer state. */
+  ranges = NULL;
+  file_is_binary = 0;
+  binary_checked = 0;
+
+  if (build_index_dir != NULL)
+    {
+      agrep_reader_start(&reader, tre_agrep_read, (void *)(intptr_t)fd, 0, 0);
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	io_start(fd);
+      int r = index_add_file(fd, filename);
+      io_finish(fd);
+      return r;
+    }
+
+#ifdef HAVE_DECOMPRESS
+  decompressing = decompress_start(&dec, fd, filename);
+  if (decompressing < 0)
+    return 1;
+  if (decompressing)
+    fd = dec.pipe_fd;
+#endif /* HAVE_DECOMPRESS */
+
+  if (stats_mode)
+    stats_begin_file(filename);
+
+  agrep_reader_start(&reader, tre_agrep_read, (void *)(intptr_t)fd, 0, 0);
+  checkpointing = 0;
+  if (checkpoint_path != NULL
+#ifdef HAVE_DECOMPRESS
+      && !decompressing
+#endif /* HAVE_DECOMPRESS */
+      && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+      long long ck_recnum = checkpoint_seek(fd, filename);
+      if (ck_recnum >= 0)
+	agrep_reader_start(&reader, tre_agrep_read, (void *)(intptr_t)fd,
+			   lseek(fd, 0, SEEK_CUR), ck_recnum);
+      checkpointing = 1;
+    }
+  else if (rc_key != NULL
+#ifdef HAVE_DECOMPRESS
+	   && !decompressing
+#endif /* HAVE_DECOMPRESS */
+	   && result_cache_lookup(fd, filename))
+    ;
+  else if (index_active)
+    index_select_ranges(fd, filename);
+  if (
+#ifdef HAVE_DECOMPRESS
+      !decompressing &&
+#endif /* HAVE_DECOMPRESS */
+      fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    io_start(fd);
+  count = tre_agrep_search_records(fd, filename);
+  io_finish(fd);
+
+  /* Only a file searched to its end, with all of its records
+     looked at, goes in the result cache. */
+  if (rc_recording)
+    {
+      if (reader.at_eof && !quit && !(list_files && count > 0)
+	  && !(file_is_binary && binary_files != BINARY_TEXT))
+	result_cache_store();
+      rc_recording = 0;
+    }
+
+  /* Only a file searched to its end has a new checkpoint. */
+  if (checkpointing && reader.at_eof)
+    checkpoint_update(fd, filename, agrep_reader_offset(&reader),
+		      reader.recnum - (reader.record_len > 0));
+  checkpointing = 0;
+
+  if (count_matches && !best_match && !be_silent)
+    print_count(stdout, filename, count);
+
+#ifdef HAVE_DECOMPRESS
+  if (decompressing)
+    decompress_finish(&dec);
+#endif /* HAVE_DECOMPRESS */
+
+  if (stats_mode)
+    stats_end_file();
+
+  return 0;
+}
+
+static int
+tre_agrep_handle_file(const char *filename)
+{
+  int fd;
+
+  if (!filename || strcmp(filename, "-") == 0)
+    {
+      if (best_match)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name,
+		  _("Cannot use -B when reading from standard input."));
+	  return 2;
+	}
+      fd = 0;
+      filename = _("(standard input)");
+    }
+  else
+    {
+      fd = open(filename, O_RDONLY);
+    }
+
+  if (fd < 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+      return 1;
+    }
+
+  tre_agrep_handle_fd(fd, filename);
+
+  if (fd)
+    close(fd);
+
+  return 0;
+}
+
+static void
+globs_add(struct tre_agrep_globs *globs, char *pat)
+{
+  char **pats;
+
+  pats = realloc(globs->pats, (globs->n + 1) * sizeof(*pats));
+  if (pats == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  pats[globs->n++] = pat;
+  globs->pats = pats;
+}
+
+static int
+globs_match(const struct tre_agrep_globs *globs, const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < globs->n; i++)
+    if (fnmatch(globs->pats[i], name, 0) == 0)
+      return 1;
+  return 0;
+}
+
+#ifdef HAVE_PTHREAD
+/* -r with several --jobs.  The walker opens the files in the order they
+   are output and queues them; worker threads search them, each with its
+   own reader, and keep the output in memory; and the walker writes it
+   out in queue order, so it is the same as with one job.  The queue is
+   a ring of WALK_QUEUE_PER_JOB files per thread, which bounds the open
+   files and the output held.  Compressed files are left to the walker,
+   which searches them itself when their turn comes. */
+#define WALK_QUEUE_PER_JOB 4
+#define WALK_QUEUE_MAX 256
+
+struct walk_file {
+  int fd;
+  char *path;
+  int done;		     /* Searched, under `walk_lock'. */
+  int serial;		     /* Compressed, for the walker to search. */
+  int error;		     /* errno of a failed search, or 0. */
+  int binary_checked;	     /* Like `binary_checked' and `file_is_binary'. */
+  int binary;
+  unsigned long long count;  /* Selected records. */
+  char *out;		     /* Output, from open_memstream(). */
+  size_t out_len;
+};
+
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t walk_searched = PTHREAD_COND_INITIALIZER;
+
+/* The queue, under `walk_lock'. */
+static struct {
+  struct walk_file *files;   /* The ring, NULL without workers. */
+  size_t size;
+  size_t head;		     /* Next file to output, */
+  size_t next;		     /* to search, */
+  size_t tail;		     /* and free slot; all count up. */
+  int finished;
+  int stop;		     /* -q found a match, the outcome is known. */
+  pthread_t *threads;
+  int nthreads;
+} walk_pool;
+
+/* Returns nonzero once a worker has found a match for -q. */
+static int
+walk_stopped(void)
+{
+  int stop;
+
+  pthread_mutex_lock(&walk_lock);
+  stop = walk_pool.stop;
+  pthread_mutex_unlock(&walk_lock);
+  return stop;
+}
+
+/* Reads a queued file, looking at its first block for NUL bytes like
+   tre_agrep_read(). */
+static ssize_t
+walk_read(void *arg, char *data, size_t len)
+{
+  struct walk_file *f = arg;
+  ssize_t r = read(f->fd, data, len);
+
+  if (r > 0 && !f->binary_checked)
+    {
+      f->binary_checked = 1;
+      if (binary_files != BINARY_TEXT && !delim_matches_nul
+	  && memchr(data, '\0', r) != NULL)
+	f->binary = 1;
+    }
+  return r;
+}
+
+/* Searches the queued file `f' with reader `rd' and writes the text
+   output tre_agrep_search_records() would to `f->out'.  Runs in a
+   worker, so it only reads the options, which walk_start() has checked
+   need nothing else. */
+static void
+walk_search(struct walk_file *f, struct agrep_reader *rd)
+{
+  struct agrep_match m;
+  unsigned long nrecords = 0;
+  FILE *out;
+
+#ifdef HAVE_DECOMPRESS
+  {
+    unsigned char magic[COMPRESS_MAGIC_LEN];
+    ssize_t r = pread(f->fd, magic, sizeof(magic), 0);
+
+    if (r > 0 && compress_format(magic, r) != COMPRESS_NONE)
+      {
+	f->serial = 1;
+	return;
+      }
+  }
+#endif /* HAVE_DECOMPRESS */
+
+  out = open_memstream(&f->out, &f->out_len);
+  if (out == NULL || rd->buf == NULL)
+    {
+      f->error = ENOMEM;
+      if (out != NULL)
+	fclose(out);
+      return;
+    }
+  agrep_reader_start(rd, walk_read, f, 0, 0);
+  if (agrep_reader_fit(rd, f->fd) != 0)
+    f->error = ENOMEM;
+
+  while (f->error == 0)
+    {
+      int r;
+
+      if (skip_string != NULL)
+	agrep_reader_skip(rd, skip_string, skip_len);
+      r = agrep_reader_next(rd);
+      if (r <= 0)
+	{
+	  if (r < 0)
+	    f->error = errno;
+	  break;
+	}
+      if (f->binary && binary_files == BINARY_WITHOUT_MATCH)
+	break;
+      /* With -q, stop once another worker has decided the outcome. */
+      if (be_silent && (++nrecords & 1023) == 0 && walk_stopped())
+	break;
+      r = agrep_searcher_match(&searcher, rd->record, rd->record_len, &m);
+      if (r < 0)
+	{
+	  f->error = ENOMEM;
+	  break;
+	}
+      if (!r)
+	continue;
+
+      f->count++;
+      if (be_silent)
+	{
+	  pthread_mutex_lock(&walk_lock);
+	  walk_pool.stop = 1;
+	  pthread_mutex_unlock(&walk_lock);
+	  break;
+	}
+      if (list_files)
+	{
+	  fprintf(out, "%s\n", f->path);
+	  break;
+	}
+      if (count_matches)
+	continue;
+      if (f->binary)
+	{
+	  print_binary_match(out, f->path);
+	  break;
+	}
+      print_record(out, f->path, rd, &m);
+    }
+
+  if (count_matches && !be_silent)
+    print_count(out, f->path, f->count);
+  if (fclose(out) != 0 && f->error == 0)
+    f->error = ENOMEM;
+}
+
+static void *
+walk_worker(void *arg)
+{
+  struct agrep_reader rd;
+
+  (void)arg;
+  /* A failure shows as a NULL buffer, reported for each file. */
+  agrep_reader_init(&rd, &searcher);
+  pthread_mutex_lock(&walk_lock);
+  for (;;)
+    {
+      struct walk_file *f;
+
+      while (walk_pool.next == walk_pool.tail && !walk_pool.finished)
+	pthread_cond_wait(&walk_queued, &walk_lock);
+      if (walk_pool.next == walk_pool.tail)
+	break;
+      f = &walk_pool.files[walk_pool.next++ % walk_pool.size];
+      if (!walk_pool.stop)
+	{
+	  pthread_mutex_unlock(&walk_lock);
+	  walk_search(f, &rd);
+	  pthread_mutex_lock(&walk_lock);
+	}
+      f->done = 1;
+      pthread_cond_signal(&walk_searched);
+    }
+  pthread_mutex_unlock(&walk_lock);
+  agrep_reader_destroy(&rd);
+  return NULL;
+}
+
+/* Writes out what a worker found in `f', and closes it. */
+static void
+walk_output(struct walk_file *f)
+{
+  if (f->serial)
+    {
+      if (!quit)
+	tre_agrep_handle_fd(f->fd, f->path);
+    }
+  else
+    {
+      if (f->error == ENOMEM)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      if (f->out_len > 0)
+	fwrite(f->out, 1, f->out_len, stdout);
+      if (f->error != 0)
+	{
+	  fprintf(stderr, "%s: ", program_name);
+	  fprintf(stderr, _("Error reading from %s: %s\n"), f->path,
+		  strerror(f->error));
+	}
+      if (f->count > 0)
+	{
+	  have_matches = 1;
+	  if (be_silent)
+	    quit = 1;	     /* One match decides the exit status. */
+	}
+    }
+  close(f->fd);
+  free(f->path);
+  free(f->out);
+}
+
+/* Writes out the searched files at the head of the queue, in order.
+   Waits for the ones still being searched if `all' is set, or while the
+   queue is full. */
+static void
+walk_flush(int all)
+{
+  pthread_mutex_lock(&walk_lock);
+  if (walk_pool.stop)
+    {
+      /* The outcome is known, stop queueing files. */
+      have_matches = 1;
+      quit = 1;
+    }
+  while (walk_pool.head != walk_pool.tail)
+    {
+      struct walk_file *f = &walk_pool.files[walk_pool.head % walk_pool.size];
+
+      if (!f->done)
+	{
+	  if (!all && walk_pool.tail - walk_pool.head < walk_pool.size)
+	    break;
+	  pthread_cond_wait(&walk_searched, &walk_lock);
+	  continue;
+	}
+      pthread_mutex_unlock(&walk_lock);
+      walk_output(f);
+      pthread_mutex_lock(&walk_lock);
+      walk_pool.head++;
+    }
+  pthread_mutex_unlock(&walk_lock);
+}
+
+/* Queues file `fd', named `path', for the workers.  Takes ownership of
+   both. */
+static void
+walk_queue(int fd, char *path)
+{
+  struct walk_file *f;
+
+  walk_flush(0);
+  f = &walk_pool.files[walk_pool.tail % walk_pool.size];
+  memset(f, 0, sizeof(*f));
+  f->fd = fd;
+  f->path = path;
+  pthread_mutex_lock(&walk_lock);
+  walk_pool.tail++;
+  pthread_cond_signal(&walk_queued);
+  pthread_mutex_unlock(&walk_lock);
+}
+
+/* Starts the workers for a walk, if there is to be more than one and
+   the options leave each file's output to depend on that file only. */
+static void
+walk_start(void)
+{
+  int n = walk_jobs;
+
+  if (n <= 0)
+    {
+      long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+      n = ncpu > 0 ? (int)ncpu : 1;
+    }
+  if (n < 2 || output_format != OUTPUT_TEXT || best_match || stats_mode
+      || color_option || indent != 0 || checkpoint_path != NULL
+      || rc_key != NULL || index_active || build_index_dir != NULL
+      || direct_io)
+    return;
+
+  walk_pool.size = MIN((size_t)n * WALK_QUEUE_PER_JOB, WALK_QUEUE_MAX);
+  walk_pool.files = xrealloc(NULL, walk_pool.size * sizeof(*walk_pool.files));
+  walk_pool.threads = xrealloc(NULL, n * sizeof(*walk_pool.threads));
+  walk_pool.head = walk_pool.next = walk_pool.tail = 0;
+  walk_pool.finished = 0;
+  walk_pool.stop = 0;
+  for (walk_pool.nthreads = 0; walk_pool.nthreads < n; walk_pool.nthreads++)
+    if (pthread_create(&walk_pool.threads[walk_pool.nthreads], NULL,
+		       walk_worker, NULL) != 0)
+      break;
+  if (walk_pool.nthreads == 0)
+    {
+      /* No threads to be had, walk on our own. */
+      free(walk_pool.files);
+      free(walk_pool.threads);
+      walk_pool.files = NULL;
+    }
+}
+
+/* Writes out the rest of the queue and stops the workers. */
+static void
+walk_stop(void)
+{
+  int i;
+
+  if (walk_pool.files == NULL)
+    return;
+  walk_flush(1);
+  pthread_mutex_lock(&walk_lock);
+  walk_pool.finished = 1;
+  pthread_cond_broadcast(&walk_queued);
+  pthread_mutex_unlock(&walk_lock);
+  for (i = 0; i < walk_pool.nthreads; i++)
+    pthread_join(walk_pool.threads[i], NULL);
+  free(walk_pool.files);
+  free(walk_pool.threads);
+  walk_pool.files = NULL;
+  walk_pool.threads = NULL;
+}
+#endif /* HAVE_PTHREAD */
+
+/* Searches the regular file open as `fd', named `path', or queues it for
+   the workers.  Takes ownership of both. */
+static void
+walk_file(int fd, char *path)
+{
+#ifdef HAVE_PTHREAD
+  if (walk_pool.files != NULL)
+    {
+      walk_queue(fd, path);
+      return;
+    }
+#endif /* HAVE_PTHREAD */
+  tre_agrep_handle_fd(fd, path);
+  close(fd);
+  free(path);
+}
+
+/* A directory on the path from the command line argument to the
+   directory being walked, used to detect symbolic link loops. */
+struct tre_agrep_dir {
+  const struct tre_agrep_dir *parent;
+  dev_t dev;
+  ino_t ino;
+};
+
+struct tre_agrep_dirent {
+  char *name;
+  unsigned char type;
+};
+
+static int
+dirent_compare(const void *a, const void *b)
+{
+  return strcmp(((const struct tre_agrep_dirent *)a)->name,
+		((const struct tre_agrep_dirent *)b)->name);
+}
+
+/* Searches all files below the directory open as `fd', which is named
+   `prefix' in the output (or nothing for the implicit working
+   directory).  Entries are visited in sorted order so the output does
+   not depend on the order the file system returns them in.  The walk
+   is serial even with --jobs, so that files are found in output order;
+   only their search goes to the workers.  Takes ownership of `fd'. */
+static void
+tre_agrep_walk_dir(int fd, const char *prefix, const struct tre_agrep_dir *here)
+{
+  DIR *dir;
+  struct dirent *de;
+  struct tre_agrep_dirent *ents = NULL;
+  size_t nents = 0, ents_size = 0, i;
+  int nofollow = follow_symlinks ? 0 : O_NOFOLLOW;
+
+  dir = fdopendir(fd);
+  if (dir == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name,
+	      prefix ? prefix : ".", strerror(errno));
+      close(fd);
+      return;
+    }
+
+  errno = 0;
+  while ((de = readdir(dir)) != NULL)
+    {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	continue;
+      if (nents == ents_size)
+	{
+	  struct tre_agrep_dirent *tmp;
+	  ents_size = ents_size ? ents_size * 2 : 64;
+	  tmp = realloc(ents, ents_size * sizeof(*ents));
+	  if (tmp == NULL)
+	    {
+	      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	      exit(2);
+	    }
+	  ents = tmp;
+	}
+      ents[nents].name = strdup(de->d_name);
+      ents[nents].type = de->d_type;
+      if (ents[nents].name == NULL)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      nents++;
+      errno = 0;
+    }
+  if (errno != 0)
+    fprintf(stderr, "%s: %s: %s\n", program_name,
+	    prefix ? prefix : ".", strerror(errno));
+
+  qsort(ents, nents, sizeof(*ents), dirent_compare);
+
+  for (i = 0; i < nents; i++)
+    {
+      const char *name = ents[i].name;
+      unsigned char type = ents[i].type;
+      char *path;
+      struct stat st;
+      int cfd;
+
+      if (quit || (type == DT_LNK && !follow_symlinks))
+	goto next;
+      if (type == DT_UNKNOWN || type == DT_LNK)
+	{
+	  if (fstatat(dirfd(dir), name, &st,
+		      follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+	    goto next;
+	  if (S_ISDIR(st.st_mode))
+	    type = DT_DIR;
+	  else if (S_ISREG(st.st_mode))
+	    type = DT_REG;
+	  else
+	    goto next;
+	}
+
+      path = path_join(prefix, name);
+      if (path == NULL)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+
+      if (type == DT_DIR)
+	{
+	  struct tre_agrep_dir sub;
+	  const struct tre_agrep_dir *d;
+
+	  if (globs_match(&exclude_dir_globs, name))
+	    goto next_path;
+	  cfd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | nofollow);
+	  if (cfd < 0 || fstat(cfd, &st) != 0)
+	    {
+	      fprintf(stderr, "%s: %s: %s\n", program_name, path,
+		      strerror(errno));
+	      if (cfd >= 0)
+		close(cfd);
+	      goto next_path;
+	    }
+	  if (one_file_system && st.st_dev != here->dev)
+	    {
+	      close(cfd);
+	      goto next_path;
+	    }
+	  for (d = here; d != NULL; d = d->parent)
+	    if (d->dev == st.st_dev && d->ino == st.st_ino)
+	      break;
+	  if (d != NULL)
+	    {
+	      fprintf(stderr, _("%s: warning: %s: recursive directory loop\n"),
+		      program_name, path);
+	      close(cfd);
+	      goto next_path;
+	    }
+	  sub.parent = here;
+	  sub.dev = st.st_dev;
+	  sub.ino = st.st_ino;
+	  tre_agrep_walk_dir(cfd, path, &sub);
+	}
+      else if (type == DT_REG)
+	{
+	  if (include_globs.n != 0 && !globs_match(&include_globs, name))
+	    goto next_path;
+	  if (globs_match(&exclude_globs, name))
+	    goto next_path;
+	  cfd = openat(dirfd(dir), name, O_RDONLY | O_NOCTTY | nofollow);
+	  if (cfd < 0)
+	    {
+	      fprintf(stderr, "%s: %s: %s\n", program_name, path,
+		      strerror(errno));
+	      goto next_path;
+	    }
+	  walk_file(cfd, path);
+	  path = NULL;
+	}
+
+    next_path:
+      free(path);
+    next:
+      free(ents[i].name);
+    }
+
+  free(ents);
+  closedir(dir);
+}
+
+/* Searches `filename', descending into it if it is a directory and -r
+   was given. */
+static int
+tre_agrep_handle_path(const char *filename)
+{
+  struct stat st;
+  struct tre_agrep_dir root;
+  int fd;
+
+  if (!recursive || !filename || strcmp(filename, "-") == 0
+      || stat(filename, &st) != 0 || !S_ISDIR(st.st_mode))
+    return tre_agrep_handle_file(filename);
+
+  fd = open(filename, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+      return 1;
+    }
+  root.parent = NULL;
+  root.dev = st.st_dev;
+  root.ino = st.st_ino;
+#ifdef HAVE_PTHREAD
+  walk_start();
+#endif /* HAVE_PTHREAD */
+  tre_agrep_walk_dir(fd, walk_strip_dot && strcmp(filename, ".") == 0
+		     ? NULL : filename, &root);
+#ifdef HAVE_PTHREAD
+  walk_stop();
+#endif /* HAVE_PTHREAD */
+  return 0;
+}
+
+
+
+/* --follow.  All the FILEs are searched to their end, and then followed
+   like `tail -F' does: more data appended to a file is searched as it
+   arrives, a truncated file is searched again from its start, and when
+   a file is replaced (e.g. rotated) the rest of the old file is
+   searched, then the new one from its start.  inotify (or, without it,
+   polling once a second) tells us when to look at the files again.  A
+   partial last record is searched only after it has not grown for
+   `follow_timeout' milliseconds. */
+
+/* Searches the records that are complete in followed file `f'. */
+static void
+follow_search(struct tre_agrep_follow *f)
+{
+  if (f->fd < 0 || f->done)
+    return;
+  reader = f->reader;
+  file_is_binary = f->binary;
+  binary_checked = f->binary_checked;
+  follow_current = f;
+  tre_agrep_search_records(f->fd, f->name);
+  follow_current = NULL;
+  f->binary = file_is_binary;
+  f->binary_checked = binary_checked;
+  f->reader = reader;
+}
+
+/* Starts searching `f' from its start, on the newly opened `f->fd'. */
+static void
+follow_start(struct tre_agrep_follow *f)
+{
+  struct stat st;
+
+  f->regular = 1;
+  if (fstat(f->fd, &st) == 0)
+    {
+      f->dev = st.st_dev;
+      f->ino = st.st_ino;
+      f->regular = S_ISREG(st.st_mode);
+    }
+  /* Don't block on pipes; poll() says when there is more. */
+  if (!f->regular && !isatty(f->fd))
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_NONBLOCK);
+  f->binary = 0;
+  f->binary_checked = 0;
+  f->partial_len = 0;
+  agrep_reader_start(&f->reader, tre_agrep_read, (void *)(intptr_t)f->fd,
+		     0, 0);
+}
+
+/* Opens `f' if it has appeared, and handles truncation and replacement. */
+static void
+follow_check(struct tre_agrep_follow *f)
+{
+  struct stat st;
+
+  if (f->path == NULL || (f->fd >= 0 && !f->regular))
+    return;
+  if (stat(f->path, &st) != 0)
+    {
+      /* Gone, for now.  Keep reading what is left of the old file. */
+      if (f->fd < 0 && !f->reported)
+	{
+	  fprintf(stderr, "%s: %s: %s\n", program_name, f->name,
+		  strerror(errno));
+	  f->reported = 1;
+	}
+      return;
+    }
+
+  if (f->fd >= 0 && st.st_dev == f->dev && st.st_ino == f->ino)
+    {
+      off_t pos = lseek(f->fd, 0, SEEK_CUR);
+
+      if (pos != (off_t)-1 && st.st_size < pos)
+	{
+	  fprintf(stderr, _("%s: %s: file truncated\n"), program_name,
+		  f->name);
+	  lseek(f->fd, 0, SEEK_SET);
+	  follow_start(f);
+	}
+      return;
+    }
+
+  if (f->fd >= 0)
+    {
+      /* Replaced.  Search the rest of the old file, including its
+	 partial last record, before switching to the new file. */
+      f->flush_partial = 1;
+      follow_search(f);
+      f->flush_partial = 0;
+      close(f->fd);
+      fprintf(stderr, _("%s: %s: file replaced, following the new file\n"),
+	      program_name, f->name);
+    }
+  f->fd = open(f->path, O_RDONLY);
+  if (f->fd < 0)
+    {
+      if (!f->reported)
+	fprintf(stderr, "%s: %s: %s\n", program_name, f->name,
+		strerror(errno));
+      f->reported = 1;
+      return;
+    }
+  f->reported = 0;
+  follow_start(f);
+}
+
+#ifdef HAVE_INOTIFY
+/* Watches the directory of `path', which also reports changes to the
+   files in it, and the creation of a file to replace `path'.  Returns
+   0, or -1 if the directory cannot be watched. */
+static int
+follow_watch(int ifd, const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  char *dir;
+  int wd;
+
+  if (slash == NULL)
+    dir = strdup(".");
+  else if (slash == path)
+    dir = strdup("/");
+  else
+    dir = strndup(path, slash - path);
+  if (dir == NULL)
+    return -1;
+  wd = inotify_add_watch(ifd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+			 | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+			 | IN_MOVED_TO);
+  free(dir);
+  return wd < 0 ? -1 : 0;
+}
+#endif /* HAVE_INOTIFY */
+
+/* Searches and follows the FILEs in argv[optind..], or standard input.
+   Returns only when all inputs are pipes that were closed, or with -q
+   after a match. */
+static int
+tre_agrep_follow(int argc, char **argv)
+{
+  struct tre_agrep_follow *follows;
+  struct pollfd *pfds;
+  int nfollows = argc > optind ? argc - optind : 1;
+  int ifd = -1, poll_files = 1;
+  int i;
+
+  follows = calloc(nfollows, sizeof(*follows));
+  pfds = calloc(nfollows + 1, sizeof(*pfds));
+  if (follows == NULL || pfds == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+#ifdef HAVE_INOTIFY
+  ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  poll_files = ifd < 0;
+#endif /* HAVE_INOTIFY */
+
+  for (i = 0; i < nfollows; i++)
+    {
+      struct tre_agrep_follow *f = &follows[i];
+
+      if (agrep_reader_init(&f->reader, &searcher) != 0)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  exit(2);
+	}
+      f->fd = -1;
+      if (argc <= optind || strcmp(argv[optind + i], "-") == 0)
+	{
+	  f->name = _("(standard input)");
+	  f->fd = 0;
+	  follow_start(f);
+	  continue;
+	}
+      f->name = f->path = argv[optind + i];
+      follow_check(f);
+#ifdef HAVE_INOTIFY
+      if (ifd >= 0 && follow_watch(ifd, f->path) != 0)
+	poll_files = 1;
+#endif /* HAVE_INOTIFY */
+    }
+
+  while (!quit)
+    {
+      unsigned long long now;
+      int timeout = -1, npfds = 0, active = 0;
+
+      for (i = 0; i < nfollows && !quit; i++)
+	{
+	  follow_check(&follows[i]);
+	  follow_search(&follows[i]);
+	}
+      if (quit)
+	break;
+      fflush(stdout);
+
+      /* Work out what to wait for, and for how long. */
+      now = stats_now();
+      if (ifd >= 0)
+	{
+	  pfds[npfds].fd = ifd;
+	  pfds[npfds++].events = POLLIN;
+	}
+      for (i = 0; i < nfollows; i++)
+	{
+	  struct tre_agrep_follow *f = &follows[i];
+
+	  if (f->done)
+	    continue;
+	  active++;
+	  if (f->fd >= 0 && !f->regular)
+	    {
+	      pfds[npfds].fd = f->fd;
+	      pfds[npfds++].events = POLLIN;
+	    }
+	  if (f->fd < 0 || f->reader.data_len == 0)
+	    f->partial_len = 0;
+	  else
+	    {
+	      unsigned long long left;
+
+	      if (f->reader.data_len != f->partial_len)
+		{
+		  f->partial_len = f->reader.data_len;
+		  f->partial_since = now;
+		}
+	      left = f->partial_since + follow_timeout * 1000000ULL;
+	      left = left > now ? (left - now + 999999) / 1000000 : 0;
+	      if (timeout < 0 || (int)left < timeout)
+		timeout = (int)left;
+	    }
+	}
+      if (active == 0)
+	break;
+      if (poll_files && (timeout < 0 || timeout > 1000))
+	timeout = 1000;
+
+      if (poll(pfds, npfds, timeout) < 0 && errno != EINTR)
+	{
+	  fprintf(stderr, "%s: poll: %s\n", program_name, strerror(errno));
+	  break;
+	}
+#ifdef HAVE_INOTIFY
+      if (ifd >= 0)
+	{
+	  /* We look at all the files anyway, just drain the events. */
+	  char events[4096];
+	  while (read(ifd, events, sizeof(events)) > 0)
+	    ;
+	}
+#endif /* HAVE_INOTIFY */
+
+      now = stats_now();
+      for (i = 0; i < nfollows; i++)
+	{
+	  struct tre_agrep_follow *f = &follows[i];
+	  if (f->reader.data_len > 0 && f->reader.data_len == f->partial_len
+	      && now - f->partial_since >= follow_timeout * 1000000ULL)
+	    f->flush_partial = 1;
+	}
+    }
+
+  fflush(stdout);
+  for (i = 0; i < nfollows; i++)
+    {
+      if (follows[i].fd > 0)
+	close(follows[i].fd);
+      agrep_reader_destroy(&follows[i].reader);
+    }
+  if (ifd >= 0)
+    close(ifd);
+  free(follows);
+  free(pfds);
+  reader.buf = NULL;
+  return have_matches == 0;
+}
+
+
+/* Compiled patterns kept by a --serve worker, so that a request that
+   repeats a recent pattern and delimiter skips tre_regcomp().  The
+   costs and error limits are matching parameters in TRE, not part of
+   the compiled pattern, so the key is just the regexp and the flags. */
+#define PATTERN_CACHE_SIZE 64
+
+struct tre_agrep_pattern {
+  char *regexp;
+  int cflags;
+  regex_t re;
+  unsigned long long used;   /* Time of last use, for LRU eviction. */
+};
+
+static int serving;	     /* True in --serve workers. */
+static struct tre_agrep_pattern pattern_cache[PATTERN_CACHE_SIZE];
+static unsigned long long pattern_clock;
+
+/* Like tre_regcomp(), but in --serve workers the result comes from, and
+   is added to, the pattern cache.  Cached patterns must not be freed by
+   the caller. */
+static int
+tre_agrep_regcomp(regex_t *re, const char *regexp, int cflags)
+{
+  struct tre_agrep_pattern *p, *victim;
+  char *copy;
+  int errcode;
+
+  if (!serving)
+    return tre_regcomp(re, regexp, cflags);
+
+  victim = &pattern_cache[0];
+  for (p = pattern_cache; p < pattern_cache + PATTERN_CACHE_SIZE; p++)
+    {
+      if (p->regexp != NULL && p->cflags == cflags
+	  && strcmp(p->regexp, regexp) == 0)
+	{
+	  p->used = ++pattern_clock;
+	  *re = p->re;
+	  return REG_OK;
+	}
+      if (p->used < victim->used)
+	victim = p;
+    }
+
+  errcode = tre_regcomp(re, regexp, cflags);
+  if (errcode != REG_OK)
+    return errcode;
+  copy = strdup(regexp);
+  if (copy == NULL)
+    return REG_OK;	     /* Just do not cache it. */
+  if (victim->regexp != NULL)
+    {
+      tre_regfree(&victim->re);
+      free(victim->regexp);
+    }
+  victim->regexp = copy;
+  victim->cflags = cflags;
+  victim->re = *re;
+  victim->used = ++pattern_clock;
+  return REG_OK;
+}
+
+/* Compiles the search pattern `regexp' into `preg', first making it
+   literal for -k and matching only whole words for -w.  Returns 0 on
+   success, or 2 after printing an error message. */
+static int
+tre_agrep_compile_pattern(regex_t *preg, char *regexp, int comp_flags,
+			  int literal_string, int word_regexp)
+{
+  int errcode;
+
+  regexp = agrep_pattern_build(regexp, literal_string, word_regexp);
+  if (regexp == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      return 2;
+    }
+
+  /* Compile the pattern. */
+  errcode = tre_agrep_regcomp(preg, regexp, comp_flags);
+  free(regexp);
+  if (errcode)
+    {
+      char errbuf[256];
+      tre_regerror(errcode, preg, errbuf, sizeof(errbuf));
+      fprintf(stderr, "%s: %s: %s\n",
+	      program_name, _("Error in search pattern"), errbuf);
+      return 2;
+    }
+
+  return 0;
+}
+
+static int tre_agrep_main(int argc, char **argv);
+
+/* Resets all the options to their defaults, so that tre_agrep_main()
+   can run more than once in the same process (see --serve). */
+static void
+tre_agrep_reset_options(void)
+{
+  size_t i;
+
+#ifdef SHAW_DEBUG
+  opt_debug = false;
+#endif
+  show_help = 0;
+  free(prev_filename);
+  prev_filename = NULL;
+  indent = 0;
+  delim_after = 1;
+  have_matches = 0;
+  invert_match = 0;
+  print_filename = -1;
+  print_recnum = 0;
+  print_byte_offset = 0;
+  bulk_invert = 0;
+  skip_string = NULL;
+  print_cost = 0;
+  count_matches = 0;
+  list_files = 0;
+  color_option = 0;
+  print_position = 0;
+  binary_files = BINARY_BINARY;
+  force_decompress = 0;
+  follow_mode = 0;
+  follow_timeout = 1000;
+  checkpoint_path = NULL;
+  checkpoint_reset();
+  direct_io = 0;
+  result_cache_dir = NULL;
+  result_cache_size = 256ULL << 20;
+  free(rc_key);
+  rc_key = NULL;
+  rc_recording = 0;
+  build_index_dir = NULL;
+  index_dir = NULL;
+  index_pattern = NULL;
+  index_unload();
+  recursive = 0;
+  follow_symlinks = 0;
+  one_file_system = 0;
+  walk_strip_dot = 0;
+  walk_jobs = 0;
+  free(include_globs.pats);
+  free(exclude_globs.pats);
+  free(exclude_dir_globs.pats);
+  memset(&include_globs, 0, sizeof(include_globs));
+  memset(&exclude_globs, 0, sizeof(exclude_globs));
+  memset(&exclude_dir_globs, 0, sizeof(exclude_dir_globs));
+  best_match = 0;
+  best_cost = 0;
+  be_silent = 0;
+  quit = 0;
+  tre_regaparams_default(&searcher.params);
+  searcher.params.max_cost = 0;
+  searcher.flags = 0;
+  searcher.literal = NULL;
+  searcher.delim_literal = NULL;
+  searcher.word = 0;
+  searcher.nfactors = 0;
+  output_format = OUTPUT_TEXT;
+  out_started = 0;
+  out_len = 0;
+  highlight = "01;31";
+  stats_mode = STATS_OFF;
+  for (i = 0; i < stats_nfiles; i++)
+    free(stats_files[i].filename);
+  free(stats_files);
+  stats_files = NULL;
+  stats_nfiles = 0;
+  stats_filename = NULL;
+  memset(&file_stats, 0, sizeof(file_stats));
+}
+
+#ifdef HAVE_SERVE
+/* --serve and --client.
+
+   The server listens on a Unix domain socket and runs each request in
+   one of a pool of preforked worker processes, which keep their compiled
+   patterns (see tre_agrep_regcomp()) and their buffers from one request
+   to the next.  A request is the working directory and the command line
+   of the client; the response is its standard output and standard error
+   and finally its exit status.
+
+   Every message is a frame: a type byte, the payload length as a 32-bit
+   big-endian number, and the payload.  The client sends a `C' frame
+   (working directory), one `A' frame per argument and an `R' frame (run).
+   The server answers with any number of `O' (stdout) and `E' (stderr)
+   frames and one `X' frame holding the exit status. */
+
+#define SERVE_MAX_PAYLOAD (1 << 20)
+#define SERVE_MAX_ARGS 4096
+
+static volatile sig_atomic_t serve_stop;
+
+static int
+write_full(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = write(fd, p, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Returns 1 after reading `len' bytes, 0 at end of file before the first
+   byte, and -1 on errors and truncated data. */
+static int
+read_full(int fd, void *data, size_t len)
+{
+  char *p = data;
+  size_t got = 0;
+
+  while (got < len)
+    {
+      ssize_t n = read(fd, p + got, len - got);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (n == 0)
+	return got == 0 ? 0 : -1;
+      got += n;
+    }
+  return 1;
+}
+
+static int
+serve_send(int fd, int type, const void *data, size_t len)
+{
+  unsigned char hdr[5];
+
+  hdr[0] = type;
+  hdr[1] = (len >> 24) & 0xff;
+  hdr[2] = (len >> 16) & 0xff;
+  hdr[3] = (len >> 8) & 0xff;
+  hdr[4] = len & 0xff;
+  if (write_full(fd, hdr, sizeof(hdr)) != 0)
+    return -1;
+  return len ? write_full(fd, data, len) : 0;
+}
+
+/* Reads a frame into `*data', a malloc()ed buffer with a terminating NUL.
+   Returns the same as read_full(). */
+static int
+serve_recv(int fd, int *type, char **data, size_t *len)
+{
+  unsigned char hdr[5];
+  int r;
+
+  r = read_full(fd, hdr, sizeof(hdr));
+  if (r <= 0)
+    return r;
+  *type = hdr[0];
+  *len = ((size_t)hdr[1] << 24) | ((size_t)hdr[2] << 16)
+    | ((size_t)hdr[3] << 8) | hdr[4];
+  if (*len > SERVE_MAX_PAYLOAD)
+    return -1;
+  *data = xrealloc(NULL, *len + 1);
+  if (read_full(fd, *data, *len) < 0)
+    {
+      free(*data);
+      return -1;
+    }
+  (*data)[*len] = '\0';
+  return 1;
+}
+
+/* A stdio stream that sends what is written to it as frames. */
+struct serve_stream {
+  int fd;
+  int type;
+};
+
+static ssize_t
+serve_stream_write(void *cookie, const char *data, size_t len)
+{
+  struct serve_stream *s = cookie;
+
+  if (serve_send(s->fd, s->type, data, len) != 0)
+    {
+      /* The client is gone, stop searching. */
+      quit = 1;
+      errno = EPIPE;
+      return -1;
+    }
+  return len;
+}
+
+static FILE *
+serve_stream_open(struct serve_stream *s, int fd, int type)
+{
+  cookie_io_functions_t funcs = { NULL, serve_stream_write, NULL, NULL };
+  FILE *f;
+
+  s->fd = fd;
+  s->type = type;
+  f = fopencookie(s, "w", funcs);
+  if (f != NULL)
+    setvbuf(f, NULL, _IOFBF, 65536);
+  return f;
+}
+
+/* Runs the command line of a request, and returns its exit status. */
+static int
+serve_run(int argc, char **argv)
+{
+  int status;
+
+  in_request = 1;
+  optind = 0;		     /* Reinitialize getopt. */
+  if (setjmp(request_jmp) == 0)
+    status = tre_agrep_main(argc, argv);
+  else
+    status = request_status;
+  in_request = 0;
+  if (stats_mode)
+    stats_print();
+  return status;
+}
+
+/* Reads one request from `conn', runs it and sends the response. */
+static void
+serve_request(int conn)
+{
+  struct serve_stream out_stream, err_stream;
+  FILE *saved_stdout, *saved_stderr, *out, *err;
+  char *cwd = NULL, *data;
+  char **argv;
+  int argc = 1, type, status;
+  size_t len;
+  unsigned char xbuf[4];
+
+  argv = xrealloc(NULL, (SERVE_MAX_ARGS + 2) * sizeof(*argv));
+  argv[0] = program_name;
+  for (;;)
+    {
+      if (serve_recv(conn, &type, &data, &len) <= 0)
+	goto done;
+      if (type == 'R')
+	{
+	  free(data);
+	  break;
+	}
+      else if (type == 'C' && cwd == NULL)
+	cwd = data;
+      else if (type == 'A' && argc <= SERVE_MAX_ARGS)
+	argv[argc++] = data;
+      else
+	{
+	  free(data);
+	  goto done;
+	}
+    }
+  argv[argc] = NULL;
+
+  out = serve_stream_open(&out_stream, conn, 'O');
+  err = serve_stream_open(&err_stream, conn, 'E');
+  if (out == NULL || err == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+      exit(2);
+    }
+  saved_stdout = stdout;
+  saved_stderr = stderr;
+  stdout = out;
+  stderr = err;
+
+  if (cwd == NULL || chdir(cwd) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, cwd ? cwd : "",
+	      strerror(cwd ? errno : EINVAL));
+      status = 2;
+    }
+  else
+    status = serve_run(argc, argv);
+
+  fclose(out);
+  fclose(err);
+  stdout = saved_stdout;
+  stderr = saved_stderr;
+  xbuf[0] = (status >> 24) & 0xff;
+  xbuf[1] = (status >> 16) & 0xff;
+  xbuf[2] = (status >> 8) & 0xff;
+  xbuf[3] = status & 0xff;
+  serve_send(conn, 'X', xbuf, sizeof(xbuf));
+
+ done:
+  while (argc > 1)
+    free(argv[--argc]);
+  free(argv);
+  free(cwd);
+}
+
+/* Returns nonzero if the peer on `conn' runs as our own user.  Where
+   the system cannot tell, the socket's 0600 mode is the only check. */
+static int
+serve_peer_ok(int conn)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return 0;
+  return cred.uid == geteuid();
+#else /* !SO_PEERCRED */
+  return 1;
+#endif /* !SO_PEERCRED */
+}
+
+static void
+serve_worker(int sock)
+{
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  serving = 1;
+  for (;;)
+    {
+      int conn = accept(sock, NULL, NULL);
+      if (conn < 0)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  fprintf(stderr, "%s: accept: %s\n", program_name, strerror(errno));
+	  _exit(2);
+	}
+      if (serve_peer_ok(conn))
+	serve_request(conn);
+      close(conn);
+    }
+}
 
-              char *rec;
-              size_t len;
-              size_t col;
+static pid_t
+serve_spawn(int sock)
+{
+  pid_t pid = fork();
 
-              rec = record;
-              len = record_len;
-              col = 0;
+  if (pid == 0)
+    serve_worker(sock);
+  else if (pid < 0)
+    fprintf(stderr, "%s: fork: %s\n", program_name, strerror(errno));
+  return pid;
+}
 
-              while (true) {
-                  // Print leading context, before the matching text.
-                  print_record_indent(rec, pmatch[0].rm_so, &col);
+static void
+serve_signal(int sig)
+{
+  (void)sig;
+  serve_stop = 1;
+}
 
-                  // Print the matching text itself, in color.
-                  printf("\33[%sm", highlight);
-                  print_record_indent(rec + pmatch[0].rm_so, pmatch[0].rm_eo - pmatch[0].rm_so, &col);
-                  fputs("\33[00m", stdout);
+/* Runs the server on the socket `path' with `nworkers' workers, until
+   SIGTERM or SIGINT. */
+static int
+tre_agrep_serve(const char *path, int nworkers)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct stat st;
+  mode_t old_mask;
+  pid_t *workers;
+  int sock, fd, i;
 
-                  /*
-                   * Advance to after the first match.
-                   * Test if there are any more matches.
-                   * If so, print them in color as well.
-                   * If not, then print the trailing context, and we are done.
-                   */
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path,
+	      strerror(ENAMETOOLONG));
+      return 2;
+    }
+  strcpy(addr.sun_path, path);
 
-                  rec += pmatch[0].rm_eo;
-                  len -= pmatch[0].rm_so;
-                  len -= pmatch[0].rm_eo - pmatch[0].rm_so;
-                  if (len == 0) {
-                      break;
-                  }
-                  errcode = tre_reganexec(&preg, rec, len, &match, match_params, 0);
-                  if (errcode != REG_OK) {
-                      print_record_indent(rec, len, &col);
-                      break;
-                  }
-              }
-          }
-	      else
-		{
-#ifdef SHAW_DEBUG
-              if (opt_debug) {
-                  fprintf(stderr, "    record_len=%d\n", record_len);
-		          fprintf(stderr,
-                    "    fwrite(record=%p=buf+%zu, record_len=%d, 1, stdout)\n",
-                    record, record - buf, record_len);
-              }
-#endif
-              if (indent != 0) {
-                  size_t col;
-                  col = 0;
-                  print_record_indent(record, record_len, &col);
-              }
-              else {
-                  fwrite(record, record_len, 1, stdout);
-              }
-		}
-	    }
+  /* Replace the socket of an earlier server, but nothing else. */
+  if (lstat(path, &st) == 0)
+    {
+      if (!S_ISSOCK(st.st_mode))
+	{
+	  fprintf(stderr, "%s: %s: %s\n", program_name, path,
+		  _("File exists and is not a socket"));
+	  return 2;
 	}
+      unlink(path);
     }
 
-  if (count_matches && !best_match && !be_silent)
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    {
+      fprintf(stderr, "%s: socket: %s\n", program_name, strerror(errno));
+      return 2;
+    }
+  /* Requests run with our permissions, so only our user may connect. */
+  old_mask = umask(077);
+  i = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if (i != 0 || listen(sock, SOMAXCONN) != 0)
     {
-      if (print_filename)
-	printf("%s:", filename);
-      printf("%d\n", count);
+      fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+      close(sock);
+      return 2;
     }
 
-  if (fd)
-    close(fd);
+  /* Requests never read the server's standard input. */
+  fd = open("/dev/null", O_RDONLY);
+  if (fd >= 0)
+    {
+      dup2(fd, STDIN_FILENO);
+      if (fd != STDIN_FILENO)
+	close(fd);
+    }
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  if (nworkers <= 0)
+    {
+      long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+      nworkers = ncpu > 0 ? (int)ncpu : 1;
+    }
+  workers = xrealloc(NULL, nworkers * sizeof(*workers));
+  fflush(NULL);
+  for (i = 0; i < nworkers; i++)
+    workers[i] = serve_spawn(sock);
+
+  /* Replace workers that die, e.g. after running out of memory. */
+  while (!serve_stop)
+    {
+      pid_t pid = wait(NULL);
+      if (pid < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != ECHILD)
+	    break;
+	  sleep(1);
+	  pid = 0;
+	}
+      for (i = 0; i < nworkers; i++)
+	if (workers[i] == pid || workers[i] <= 0)
+	  {
+	    workers[i] = serve_spawn(sock);
+	    if (workers[i] < 0)
+	      sleep(1);
+	  }
+    }
 
+  for (i = 0; i < nworkers; i++)
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+  close(sock);
+  unlink(path);
+  free(workers);
   return 0;
 }
 
+/* Sends the command line `argv' to the server on socket `path', and
+   copies the output of the request to our standard output and standard
+   error.  Returns the exit status of the request. */
+static int
+tre_agrep_client(const char *path, int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  char *cwd, *data;
+  int sock, type, i, r;
+  size_t len;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path,
+	      strerror(ENAMETOOLONG));
+      return 2;
+    }
+  strcpy(addr.sun_path, path);
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0
+      || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+      return 2;
+    }
 
+  signal(SIGPIPE, SIG_IGN);
+  cwd = getcwd(NULL, 0);
+  if (cwd == NULL
+      || serve_send(sock, 'C', cwd, strlen(cwd)) != 0)
+    goto lost;
+  free(cwd);
+  for (i = 0; i < argc; i++)
+    if (serve_send(sock, 'A', argv[i], strlen(argv[i])) != 0)
+      goto lost;
+  if (serve_send(sock, 'R', NULL, 0) != 0)
+    goto lost;
 
-int
-main(int argc, char **argv)
+  while ((r = serve_recv(sock, &type, &data, &len)) > 0)
+    {
+      if (type == 'O')
+	fwrite(data, 1, len, stdout);
+      else if (type == 'E')
+	{
+	  fflush(stdout);
+	  fwrite(data, 1, len, stderr);
+	}
+      else if (type == 'X' && len == 4)
+	{
+	  unsigned char *x = (unsigned char *)data;
+	  int status = (x[0] << 24) | (x[1] << 16) | (x[2] << 8) | x[3];
+	  free(data);
+	  close(sock);
+	  return status;
+	}
+      free(data);
+    }
+
+ lost:
+  fprintf(stderr, "%s: %s: %s\n", program_name, path,
+	  _("connection to server lost"));
+  close(sock);
+  return 2;
+}
+#endif /* HAVE_SERVE */
+
+static int
+tre_agrep_main(int argc, char **argv)
 {
   int c, errcode;
   int comp_flags = REG_EXTENDED;
@@ -754,33 +5264,11 @@ main(int argc, char **argv)
   int word_regexp = 0;
   int literal_string = 0;
   int max_cost_set = 0;
-
-  setlocale (LC_ALL, "");
-  bindtextdomain (PACKAGE, LOCALEDIR);
-  textdomain (PACKAGE);
-
-  /* Get the program name without the path (for error messages etc). */
-  if (argv[0]) {
-      char *arg0;
-      char *tmp_str;
-
-      arg0 = argv[0];
-      tmp_str = strrchr(arg0, '/');
-      if (tmp_str) {
-          arg0 = tmp_str + 1;
-      }
-      program_name = arg0;
-  }
-  else {
-      program_name = "???";
-  }
+  const char *serve_path = NULL;
+  int serve_workers = 0;
 
   /* Defaults. */
-  print_filename = -1;
-  print_cost = 0;
-  be_silent = 0;
-  tre_regaparams_default(&match_params);
-  match_params.max_cost = 0;
+  tre_agrep_reset_options();
 
   /* Parse command line options. */
   while (1)
@@ -800,6 +5288,23 @@ main(int argc, char **argv)
       opt_debug = true;
       break;
 #endif
+	case 'a':
+	  /* Treat binary files as text. */
+	  binary_files = BINARY_TEXT;
+	  break;
+	case 'b':
+	  /* Print byte offset of matching record. */
+	  print_byte_offset = 1;
+	  break;
+	case 'Z':
+	  /* Decompress input that is not a regular file, too. */
+#ifndef HAVE_DECOMPRESS
+	  fprintf(stderr, _("%s: -Z: decompression support not compiled in\n"),
+		  program_name);
+	  tre_agrep_exit(2);
+#endif /* !HAVE_DECOMPRESS */
+	  force_decompress = 1;
+	  break;
 	case 'c':
 	  /* Count number of matching records. */
 	  count_matches = 1;
@@ -840,6 +5345,15 @@ main(int argc, char **argv)
 	case 'q':
 	  be_silent = 1;
 	  break;
+	case 'r':
+	  /* Search directories recursively. */
+	  recursive = 1;
+	  break;
+	case 'R':
+	  /* Search directories recursively, following symbolic links. */
+	  recursive = 1;
+	  follow_symlinks = 1;
+	  break;
 	case 's':
 	  /* Print match cost of matching record. */
 	  print_cost = 1;
@@ -861,11 +5375,11 @@ main(int argc, char **argv)
 	  break;
 	case 'D':
 	  /* Set the cost of a deletion. */
-	  match_params.cost_del = atoi(optarg);
+	  searcher.params.cost_del = atoi(optarg);
 	  break;
 	case 'E':
 	  /* Set the maximum number of errors allowed for a record to match. */
-	  match_params.max_cost = atoi(optarg);
+	  searcher.params.max_cost = atoi(optarg);
 	  max_cost_set = 1;
 	  break;
 	case 'H':
@@ -874,7 +5388,7 @@ main(int argc, char **argv)
 	  break;
 	case 'I':
 	  /* Set the cost of an insertion. */
-	  match_params.cost_ins = atoi(optarg);
+	  searcher.params.cost_ins = atoi(optarg);
 	  break;
 	case 'M':
 	  /* Print delimiters after matches instead of before. */
@@ -882,7 +5396,7 @@ main(int argc, char **argv)
 	  break;
 	case 'S':
 	  /* Set the cost of a substitution. */
-	  match_params.cost_subst = atoi(optarg);
+	  searcher.params.cost_subst = atoi(optarg);
 	  break;
 	case 'V':
 	  {
@@ -896,7 +5410,7 @@ With modification by Guy Shaw <gshaw@acm.org>  2016-2020.\n\
 Build time: 2020-02-29 23:02:32\n\
     (date --reference=agrep.c '+%Y-%m-%d %H:%M:%S')\n\
     \n"), stdout);
-	    exit(0);
+	    tre_agrep_exit(0);
 	    break;
 	  }
 	case '?':
@@ -911,13 +5425,23 @@ Build time: 2020-02-29 23:02:32\n\
 	    color_option = 1;
 	  else if (strcmp(optarg, "show-position") == 0)
 	    print_position = 1;
+	  else if (strcmp(optarg, "stats") == 0)
+	    stats_mode = STATS_TEXT;
+	  else if (strcmp(optarg, "stats=json") == 0)
+	    stats_mode = STATS_JSON;
 	  else if (strcmp(optarg, "help") == 0)
 	    show_help = 1;
+	  else if (strcmp(optarg, "recursive") == 0)
+	    recursive = 1;
+	  else if (strcmp(optarg, "one-file-system") == 0)
+	    one_file_system = 1;
+	  else if (strcmp(optarg, "follow") == 0)
+	    follow_mode = 1;
 	  else
 	    {
 	      fprintf(stderr, _("%s: invalid option --%s\n"),
 		      program_name, optarg);
-	      exit(2);
+	      tre_agrep_exit(2);
 	    }
 	  break;
 
@@ -925,9 +5449,96 @@ Build time: 2020-02-29 23:02:32\n\
 	case COLOR_OPTION:
 	  color_option = 1;
 	  break;
+	case BINARY_FILES_OPTION:
+	  if (strcmp(optarg, "binary") == 0)
+	    binary_files = BINARY_BINARY;
+	  else if (strcmp(optarg, "text") == 0)
+	    binary_files = BINARY_TEXT;
+	  else if (strcmp(optarg, "without-match") == 0)
+	    binary_files = BINARY_WITHOUT_MATCH;
+	  else
+	    {
+	      fprintf(stderr, _("%s: invalid argument `%s' for `--binary-files'\n"),
+		      program_name, optarg);
+	      tre_agrep_exit(2);
+	    }
+	  break;
+	case BUILD_INDEX_OPTION:
+	  build_index_dir = optarg;
+	  break;
+	case INDEX_OPTION:
+	  index_dir = optarg;
+	  break;
+	case INCLUDE_OPTION:
+	  globs_add(&include_globs, optarg);
+	  break;
+	case EXCLUDE_OPTION:
+	  globs_add(&exclude_globs, optarg);
+	  break;
+	case EXCLUDE_DIR_OPTION:
+	  globs_add(&exclude_dir_globs, optarg);
+	  break;
+	case ONE_FILE_SYSTEM_OPTION:
+	  one_file_system = 1;
+	  break;
+	case STATS_OPTION:
+	  if (optarg == NULL || strcmp(optarg, "text") == 0)
+	    stats_mode = STATS_TEXT;
+	  else if (strcmp(optarg, "json") == 0)
+	    stats_mode = STATS_JSON;
+	  else
+	    {
+	      fprintf(stderr, _("%s: invalid argument `%s' for `--stats'\n"),
+		      program_name, optarg);
+	      tre_agrep_exit(2);
+	    }
+	  break;
 	case SHOW_POSITION_OPTION:
 	  print_position = 1;
 	  break;
+	case SERVE_OPTION:
+	  serve_path = optarg;
+	  break;
+	case SERVE_WORKERS_OPTION:
+	  serve_workers = atoi(optarg);
+	  break;
+	case JOBS_OPTION:
+	  walk_jobs = atoi(optarg);
+	  break;
+	case FOLLOW_OPTION:
+	  follow_mode = 1;
+	  break;
+	case CHECKPOINT_OPTION:
+	  checkpoint_path = optarg;
+	  break;
+	case DIRECT_IO_OPTION:
+	  direct_io = 1;
+	  break;
+	case RESULT_CACHE_OPTION:
+	  result_cache_dir = optarg;
+	  break;
+	case RESULT_CACHE_SIZE_OPTION:
+	  result_cache_size = (unsigned long long)atoll(optarg) << 20;
+	  break;
+	case OUTPUT_OPTION:
+	  if (strcmp(optarg, "text") == 0)
+	    output_format = OUTPUT_TEXT;
+	  else if (strcmp(optarg, "ndjson") == 0)
+	    output_format = OUTPUT_NDJSON;
+	  else if (strcmp(optarg, "binary") == 0)
+	    output_format = OUTPUT_BINARY;
+	  else
+	    {
+	      fprintf(stderr, _("%s: invalid argument `%s' for `--output'\n"),
+		      program_name, optarg);
+	      tre_agrep_exit(2);
+	    }
+	  break;
+	case FOLLOW_TIMEOUT_OPTION:
+	  follow_timeout = (int)(atof(optarg) * 1000);
+	  if (follow_timeout < 0)
+	    follow_timeout = 0;
+	  break;
 #endif /* HAVE_GETOPT_LONG */
 	case 0:
 	  /* Long options without corresponding short options. */
@@ -935,7 +5546,7 @@ Build time: 2020-02-29 23:02:32\n\
 
 	default:
 	  if (c >= '0' && c <= '9')
-	    match_params.max_cost = c - '0';
+	    searcher.params.max_cost = c - '0';
 	  else
 	    tre_agrep_usage(2);
 	  max_cost_set = 1;
@@ -946,6 +5557,48 @@ Build time: 2020-02-29 23:02:32\n\
   if (show_help)
     tre_agrep_usage(0);
 
+  /* A request must not write files as the server's user, nor tie up a
+     worker indefinitely. */
+  if (serve_path != NULL
+      || (in_request && (build_index_dir != NULL || follow_mode
+			 || checkpoint_path != NULL || result_cache_dir != NULL
+			 || direct_io)))
+    {
+#ifdef HAVE_SERVE
+      if (!in_request)
+	return tre_agrep_serve(serve_path, serve_workers);
+#endif /* HAVE_SERVE */
+      fprintf(stderr, _("%s: `--%s' is not supported here\n"), program_name,
+	      serve_path != NULL ? "serve"
+	      : build_index_dir != NULL ? "build-index"
+	      : follow_mode ? "follow"
+	      : checkpoint_path != NULL ? "checkpoint"
+	      : result_cache_dir != NULL ? "result-cache" : "direct-io");
+      return 2;
+    }
+
+  if (follow_mode && (count_matches || list_files || best_match || recursive
+		      || build_index_dir != NULL || index_dir != NULL
+		      || checkpoint_path != NULL || result_cache_dir != NULL))
+    {
+      fprintf(stderr, _("%s: --follow cannot be used with -c, -l, -B, -r, "
+			"--build-index, --index, --checkpoint or "
+			"--result-cache\n"),
+	      program_name);
+      return 2;
+    }
+
+  if (output_format != OUTPUT_TEXT && (count_matches || list_files))
+    {
+      fprintf(stderr, _("%s: --output cannot be used with -c or -l\n"),
+	      program_name);
+      return 2;
+    }
+
+  /* In a --serve request, stats are printed when the request is done. */
+  if (stats_mode && !in_request)
+    atexit(stats_print);
+
   if (color_option)
     {
       char *user_highlight = getenv("GREP_COLOR");
@@ -953,129 +5606,172 @@ Build time: 2020-02-29 23:02:32\n\
 	highlight = user_highlight;
     }
 
-  /* Get the pattern. */
-  if (regexp == NULL)
-    {
-      if (optind >= argc)
-	tre_agrep_usage(2);
-      regexp = argv[optind++];
-    }
+  if (invert_match)
+    searcher.flags |= AGREP_INVERT;
+  if (color_option || print_position || output_format != OUTPUT_TEXT)
+    searcher.flags |= AGREP_SPAN;
+  if (!print_cost && !best_match && !stats_mode
+      && output_format == OUTPUT_TEXT)
+    searcher.flags |= AGREP_ANY_COST;
 
-  /* If -k is specified, make the regexp literal.  This uses
-     the \Q and \E extensions.	If the string already contains
-     occurrences of \E, we need to handle them separately.  This is a
-     pain, but can't really be avoided if we want to create a regexp
-     which works together with -w (see below). */
-  if (literal_string)
+  /* Get and compile the pattern.  --build-index takes no pattern. */
+  if (build_index_dir == NULL)
     {
-      char *next_pos = regexp;
-      char *new_re, *new_re_end;
-      int n = 0;
-      int len;
-
-      next_pos = regexp;
-      while (next_pos)
+      if (regexp == NULL)
 	{
-	  next_pos = strstr(next_pos, "\\E");
-	  if (next_pos)
-	    {
-	      n++;
-	      next_pos += 2;
-	    }
+	  if (optind >= argc)
+	    tre_agrep_usage(2);
+	  regexp = argv[optind++];
 	}
-
-      len = strlen(regexp);
-      new_re = malloc(len + 5 + n * 7);
-      if (!new_re)
+      if (literal_string || agrep_is_literal(regexp))
+	index_pattern = regexp;
+      /* An exact search for a plain string needs no regexp: it is found
+	 with memmem(), and the compile time, which grows with the
+	 length of the pattern, is saved. */
+      if (index_pattern != NULL && !(comp_flags & REG_ICASE)
+	  && !best_match && searcher.params.max_cost == 0)
 	{
-	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
-	  return 2;
+	  searcher.literal = regexp;
+	  searcher.literal_len = strlen(regexp);
 	}
-
-      next_pos = regexp;
-      new_re_end = new_re;
-      strcpy(new_re_end, "\\Q");
-      new_re_end += 2;
-      while (next_pos)
+      else if (tre_agrep_compile_pattern(&searcher.preg, regexp, comp_flags,
+					 literal_string, 0) != 0)
+	return 2;
+      /* -w checks the matches of the pattern for word boundaries, and
+	 only falls back to the pattern in \<(...)\> when that cannot
+	 tell (see agrep_searcher_match()). */
+      if (word_regexp)
 	{
-	  char *start = next_pos;
-	  next_pos = strstr(next_pos, "\\E");
-	  if (next_pos)
-	    {
-	      strncpy(new_re_end, start, next_pos - start);
-	      new_re_end += next_pos - start;
-	      strcpy(new_re_end, "\\E\\\\E\\Q");
-	      new_re_end += 7;
-	      next_pos += 2;
-	    }
-	  else
-	    {
-	      strcpy(new_re_end, start);
-	      new_re_end += strlen(start);
-	    }
+	  if (tre_agrep_compile_pattern(&searcher.word_preg, regexp,
+					comp_flags, literal_string, 1) != 0)
+	    return 2;
+	  searcher.word = 1;
+	  searcher.word_native = agrep_word_native();
 	}
-      strcpy(new_re_end, "\\E");
-      regexp = new_re;
+      /* Records without the strings that every match needs are
+	 rejected before the pattern is run. */
+      agrep_searcher_factors(&searcher, regexp, comp_flags, literal_string);
     }
 
-  /* If -w is specified, prepend beginning-of-word and end-of-word
-     assertions to the regexp before compiling. */
-  if (word_regexp)
+  /* Compile the record delimiter pattern, unless it is a plain string.
+     Those are found with memchr() or memmem(), and cannot match an empty
+     string or a NUL byte. */
+  if (agrep_is_literal(delim_regexp))
     {
-      char *tmp = regexp;
-      int len = strlen(tmp);
-      regexp = malloc(len + 7);
-      if (regexp == NULL)
+      searcher.delim_literal = delim_regexp;
+      searcher.delim_literal_len = strlen(delim_regexp);
+      delim_matches_nul = 0;
+    }
+  else
+    {
+      errcode = tre_agrep_regcomp(&searcher.delim, delim_regexp,
+				  REG_EXTENDED | REG_NEWLINE);
+      if (errcode)
 	{
-	  fprintf(stderr, "%s: %s\n", program_name, _("Out of memory"));
+	  char errbuf[256];
+	  tre_regerror(errcode, &searcher.delim, errbuf, sizeof(errbuf));
+	  fprintf(stderr, "%s: %s: %s\n",
+		  program_name, _("Error in record delimiter pattern"), errbuf);
 	  return 2;
 	}
-      strcpy(regexp, "\\<(");
-      strcpy(regexp + 3, tmp);
-      strcpy(regexp + len + 3, ")\\>");
-    }
 
-  /* Compile the pattern. */
-  errcode = tre_regcomp(&preg, regexp, comp_flags);
-  if (errcode)
-    {
-      char errbuf[256];
-      tre_regerror(errcode, &preg, errbuf, sizeof(errbuf));
-      fprintf(stderr, "%s: %s: %s\n",
-	      program_name, _("Error in search pattern"), errbuf);
-      return 2;
-    }
+      if (tre_regexec(&searcher.delim, "", 0, NULL, 0) == REG_OK)
+	{
+	  fprintf(stderr, "%s: %s\n", program_name,
+		  _("Record delimiter pattern must not match an empty string"));
+	  return 2;
+	}
 
-  /* Compile the record delimiter pattern. */
-  errcode = tre_regcomp(&delim, delim_regexp, REG_EXTENDED | REG_NEWLINE);
-  if (errcode)
-    {
-      char errbuf[256];
-      tre_regerror(errcode, &preg, errbuf, sizeof(errbuf));
-      fprintf(stderr, "%s: %s: %s\n",
-	      program_name, _("Error in record delimiter pattern"), errbuf);
-      return 2;
+      /* If the delimiter can match a NUL byte (e.g. -d '\x00'), NUL bytes
+	 are record structure, not a sign of binary data. */
+      delim_matches_nul
+	= tre_regnexec(&searcher.delim, "", 1, 0, NULL, 0) == REG_OK;
     }
 
-  if (tre_regexec(&delim, "", 0, NULL, 0) == REG_OK)
+  /* The rest of the arguments are file(s) to match. */
+
+  if (recursive && optind >= argc)
     {
-      fprintf(stderr, "%s: %s\n", program_name,
-	      _("Record delimiter pattern must not match an empty string"));
-      return 2;
+      /* With -r and no FILE, search the working directory and name
+	 the files relative to it. */
+      static char *dot_argv[] = { ".", NULL };
+      argv = dot_argv;
+      argc = 1;
+      optind = 0;
+      walk_strip_dot = 1;
     }
 
-  /* The rest of the arguments are file(s) to match. */
-
   /* If -h or -H were not specified, print filenames if there are more
-     than one files specified. */
+     than one files specified, or if directories are searched. */
   if (print_filename == -1)
     {
-      if (argc - optind <= 1)
+      if (argc - optind <= 1 && !recursive)
 	print_filename = 0;
       else
 	print_filename = 1;
     }
 
+  /* -v that outputs just the records, newline delimited, can work on
+     whole blocks of lines (see tre_agrep_search_invert()). */
+  if (invert_match && searcher.delim_literal != NULL
+      && strcmp(searcher.delim_literal, "\n") == 0 && delim_after
+      && !color_option && !print_cost && !print_byte_offset
+      && !print_position && (!print_filename || count_matches) && !indent
+      && !list_files && !be_silent && !best_match && !stats_mode
+      && output_format == OUTPUT_TEXT && !follow_mode
+      && checkpoint_path == NULL && build_index_dir == NULL)
+    {
+      if (searcher.literal == NULL
+	  && tre_agrep_compile_pattern(&invert_preg, regexp,
+				       comp_flags | REG_NEWLINE,
+				       literal_string, 0) != 0)
+	return 2;
+      bulk_invert = 1;
+    }
+
+  /* When every selected record contains some string, the records before
+     the next one with it are skipped without being looked at, and only
+     counted (see agrep_reader_skip()).  Records that are not looked at
+     cannot be -v selected, or go in --stats, and without -M, the result
+     cache needs to know the record before each selected one. */
+  if (!invert_match && !best_match && !stats_mode && !follow_mode
+      && build_index_dir == NULL && searcher.delim_literal_len == 1
+      && (delim_after || result_cache_dir == NULL))
+    {
+      skip_string = agrep_searcher_required(&searcher, &skip_len);
+      if (skip_string != NULL
+	  && memchr(skip_string, searcher.delim_literal[0], skip_len) != NULL)
+	skip_string = NULL;
+    }
+
+  if (follow_mode)
+    return tre_agrep_follow(argc, argv);
+
+  if (build_index_dir != NULL)
+    {
+      /* Index mode.  Read all the files and write the index. */
+      if (optind >= argc)
+	tre_agrep_usage(2);
+      index_build_init();
+      while (optind < argc && !quit)
+	tre_agrep_handle_path(argv[optind++]);
+      return index_write(build_index_dir, delim_regexp);
+    }
+
+  if (checkpoint_path != NULL
+      && checkpoint_load(checkpoint_path, delim_regexp) != 0)
+    return 2;
+
+  /* The result cache does not help -v, which selects most records, or
+     -B, which reads everything twice anyway. */
+  if (result_cache_dir != NULL && !invert_match && !best_match)
+    result_cache_init(regexp, comp_flags, literal_string, word_regexp,
+		      delim_regexp);
+
+  if (index_dir != NULL)
+    index_load(index_dir, delim_regexp, comp_flags,
+	       best_match && !max_cost_set ? INT_MAX : searcher.params.max_cost);
+
   if (optind >= argc)
     {
       /* There are no files specified, read from stdin. */
@@ -1087,33 +5783,73 @@ Build time: 2020-02-29 23:02:32\n\
 
       /* Best match mode.  Set up the limits first. */
       if (!max_cost_set)
-	match_params.max_cost = INT_MAX;
+	searcher.params.max_cost = INT_MAX;
       best_cost = INT_MAX;
 
       /* Scan all files once without outputting anything, searching
 	 for the best matches. */
-      while (optind < argc)
-	tre_agrep_handle_file(argv[optind++]);
+      while (optind < argc && !quit)
+	tre_agrep_handle_path(argv[optind++]);
 
       /* If there were no matches, bail out now. */
-      if (best_cost == INT_MAX)
-	return 1;
+      if (quit || best_cost == INT_MAX)
+	{
+	  if (checkpoint_save() != 0)
+	    return 2;
+	  return quit ? 0 : 1;
+	}
 
       /* Otherwise, rescan the files with max_cost set to the cost
 	 of the best match found previously, this time outputting
 	 the matches. */
-      match_params.max_cost = best_cost;
+      searcher.params.max_cost = best_cost;
       best_match = 2;
       optind = first_ind;
-      while (optind < argc)
-	tre_agrep_handle_file(argv[optind++]);
+      while (optind < argc && !quit)
+	tre_agrep_handle_path(argv[optind++]);
     }
   else
     {
       /* Normal mode. */
-      while (optind < argc)
-	tre_agrep_handle_file(argv[optind++]);
+      while (optind < argc && !quit)
+	tre_agrep_handle_path(argv[optind++]);
     }
 
+  result_cache_evict();
+  if (checkpoint_save() != 0)
+    return 2;
   return have_matches == 0;
 }
+
+int
+main(int argc, char **argv)
+{
+  setlocale (LC_ALL, "");
+  bindtextdomain (PACKAGE, LOCALEDIR);
+  textdomain (PACKAGE);
+
+  /* Get the program name without the path (for error messages etc). */
+  if (argv[0]) {
+      char *arg0;
+      char *tmp_str;
+
+      arg0 = argv[0];
+      tmp_str = strrchr(arg0, '/');
+      if (tmp_str) {
+          arg0 = tmp_str + 1;
+      }
+      program_name = arg0;
+  }
+  else {
+      program_name = "???";
+  }
+
+#ifdef HAVE_SERVE
+  /* --client=SOCKET must come first; the rest of the command line is
+     run by the server. */
+  if (argc > 1 && strncmp(argv[1], "--client=", 9) == 0)
+    return tre_agrep_client(argv[1] + 9, argc - 2, argv + 2);
+#endif /* HAVE_SERVE */
+
+  return tre_agrep_main(argc, argv);
+}
@@ -0,0 +1,160 @@
+#!/bin/bash
+#
+# agrep-bench.sh - Reproducible benchmarks for agrep
+#
+# Generates synthetic corpora from fixed seeds (see gen-corpus.c) and
+# runs a matrix of pattern types, error levels, cost weights and output
+# modes against them.  Results are written to standard output as
+# tab-separated values, one line per run, in a format that stays the
+# same from one commit to the next, so that two result files can be
+# compared with diff, join or a spreadsheet.
+#
+# Environment:
+#   AGREP          agrep binary to benchmark (default: tre-agrep)
+#   CC             C compiler for the corpus generator (default: cc)
+#   BENCH_DIR      where corpora are kept (default: ./bench-corpus)
+#   BENCH_SEED     PRNG seed (default: 1)
+#   BENCH_SIZE     approximate corpus size in bytes (default: 16 MB)
+#   BENCH_CORPORA  corpora to use (default: all)
+#   BENCH_PATTERNS pattern types to use (default: all)
+#   BENCH_ERRORS   error levels for the error sweep (default: 0 .. 9)
+#   BENCH_REPEAT   runs per measurement; the fastest is kept (default: 3)
+#
+# Corpora are regenerated only when missing or when the seed or size
+# changes.
+
+set -e
+
+AGREP=${AGREP:-tre-agrep}
+CC=${CC:-cc}
+BENCH_DIR=${BENCH_DIR:-./bench-corpus}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_SIZE=${BENCH_SIZE:-16777216}
+BENCH_CORPORA=${BENCH_CORPORA:-"logs records nul utf8 small-files"}
+BENCH_PATTERNS=${BENCH_PATTERNS:-"literal regex word icase"}
+BENCH_ERRORS=${BENCH_ERRORS:-"0 1 2 3 4 5 6 7 8 9"}
+BENCH_REPEAT=${BENCH_REPEAT:-3}
+
+srcdir=$(cd "$(dirname "$0")" && pwd)
+gen="$BENCH_DIR/gen-corpus"
+
+mkdir -p "$BENCH_DIR"
+errfile=$(mktemp)
+trap 'rm -f "$errfile"' EXIT
+if [ ! -x "$gen" ] || [ "$srcdir/gen-corpus.c" -nt "$gen" ]; then
+    $CC -O2 -o "$gen" "$srcdir/gen-corpus.c"
+fi
+
+# corpus_path KIND -- path of the corpus, generating it if needed.
+corpus_path() {
+    local kind=$1
+    local path="$BENCH_DIR/$kind-$BENCH_SEED-$BENCH_SIZE"
+
+    if [ ! -e "$path.records" ]; then
+        rm -rf "$path"
+        "$gen" "$kind" "$BENCH_SEED" "$BENCH_SIZE" "$path" > "$path.records.tmp"
+        mv "$path.records.tmp" "$path.records"
+    fi
+    echo "$path"
+}
+
+# corpus_files PATH -- the file arguments for a corpus.
+corpus_files() {
+    if [ -d "$1" ]; then
+        ls "$1"/* | sort
+    else
+        echo "$1"
+    fi
+}
+
+# pattern_args TYPE -- options and pattern for a pattern type.
+pattern_args() {
+    case $1 in
+    literal) echo "-k" "timeout" ;;
+    regex)   echo "opti(mi[sz]|mum)e.*(client|server)" ;;
+    word)    echo "-w" "retry" ;;
+    icase)   echo "-i" "CONNECTION" ;;
+    esac
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# run KIND PATTERN ERRORS COSTS MODE -- time one configuration and
+# print its result line.
+run() {
+    local kind=$1 ptype=$2 errors=$3 costs=$4 mode=$5
+    local path bytes records best t0 t1 elapsed i status
+    local -a args cost_args files delim pat
+
+    path=$(corpus_path "$kind")
+    mapfile -t files < <(corpus_files "$path")
+    bytes=$(cat "${files[@]}" | wc -c)
+    records=$(cat "$path.records")
+    read -r -a pat <<< "$(pattern_args "$ptype")"
+    case $kind in
+    records) delim=(-d "^Title: ") ;;
+    nul)     delim=(-d '\x00') ;;
+    *)       delim=() ;;
+    esac
+
+    args=("-$errors")
+    [ "$costs" != default ] && read -r -a cost_args <<< "$costs" \
+        && args+=("${cost_args[@]}")
+    [ "$mode" != default ] && args+=("$mode")
+
+    best=
+    for ((i = 0; i < BENCH_REPEAT; i++)); do
+        t0=$(now_ns)
+        status=0
+        "$AGREP" "${args[@]}" "${delim[@]}" "${pat[@]}" "${files[@]}" \
+            > /dev/null 2> "$errfile" || status=$?
+        t1=$(now_ns)
+        # 1 only means that nothing matched; anything else is a failure
+        # and the timing would be meaningless.
+        if [ "$status" -gt 1 ]; then
+            printf 'agrep-bench: exit status %d:' "$status" >&2
+            printf ' %q' "$AGREP" "${args[@]}" "${delim[@]}" "${pat[@]}" \
+                "${files[@]}" >&2
+            echo >&2
+            cat "$errfile" >&2
+            exit 1
+        fi
+        elapsed=$((t1 - t0))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+
+    awk -v k="$kind" -v p="$ptype" -v e="$errors" -v c="$costs" \
+        -v m="$mode" -v b="$bytes" -v r="$records" -v ns="$best" 'BEGIN {
+        s = ns / 1e9
+        if (s <= 0) s = 1e-9
+        printf "%s\t%s\t%s\t%s\t%s\t%d\t%d\t%.6f\t%.3f\t%.1f\n",
+            k, p, e, c, m, b, r, s, b / s / 1e6, r / s
+    }'
+}
+
+echo "# agrep-bench 1"
+echo "# agrep: $AGREP ($("$AGREP" -V 2>/dev/null | head -n 1))"
+echo "# commit: $(git -C "$srcdir" describe --always --dirty 2>/dev/null || echo unknown)"
+echo "# seed: $BENCH_SEED size: $BENCH_SIZE repeat: $BENCH_REPEAT"
+printf "corpus\tpattern\terrors\tcosts\tmode\tbytes\trecords\tseconds\tMB/s\trecords/s\n"
+
+for kind in $BENCH_CORPORA; do
+    for ptype in $BENCH_PATTERNS; do
+        # Error level sweep.
+        for errors in $BENCH_ERRORS; do
+            run "$kind" "$ptype" "$errors" default default
+        done
+        # Cost weight sweep.
+        for costs in "-D2" "-I2" "-S2" "-D1 -I2 -S3"; do
+            run "$kind" "$ptype" 2 "$costs" default
+        done
+        # Output mode sweep.
+        for mode in -c -l --color -B; do
+            run "$kind" "$ptype" 1 default "$mode"
+        done
+    done
+done
@@ -0,0 +1,266 @@
+/*
+  gen-corpus.c - Generate synthetic corpora for benchmarking agrep
+
+  This software is released under a BSD-style license.
+  See the file LICENSE for details and copyright.
+
+  Usage: gen-corpus KIND SEED SIZE OUTPUT
+
+  Writes about SIZE bytes of corpus KIND to OUTPUT (a directory for
+  the `small-files' kind).  The output depends only on KIND, SEED and
+  SIZE: the generator uses its own PRNG, so the same arguments give
+  byte-identical corpora on every machine and with every C library.
+
+  The number of records written is printed on standard output, so that
+  the benchmark driver can report records per second.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static char *program_name;
+
+/* xorshift64* -- small, fast and fully specified. */
+static unsigned long long rng_state;
+
+static void
+rng_seed(unsigned long long seed)
+{
+  rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+static unsigned long long
+rng_next(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned
+rng_below(unsigned n)
+{
+  return (unsigned)((rng_next() >> 32) % n);
+}
+
+static const char *const words[] = {
+  "request", "response", "connection", "timeout", "server", "client",
+  "session", "buffer", "record", "optimize", "optimise", "handler",
+  "socket", "retry", "commit", "index", "query", "cache", "worker",
+  "thread", "latency", "upstream", "downstream", "payload", "checksum",
+  "journal", "segment", "replica", "leader", "follower", "snapshot",
+  "the", "a", "of", "to", "and", "in", "is", "for", "with", "on"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *const levels[] = {
+  "INFO", "INFO", "INFO", "INFO", "DEBUG", "DEBUG", "WARN", "ERROR"
+};
+
+/* Words with accents, and the same words after a round trip through
+   Latin-1 (mojibake). */
+static const char *const utf8_words[] = {
+  "caf\xc3\xa9", "na\xc3\xafve", "r\xc3\xa9sum\xc3\xa9", "\xc3\xbc" "ber",
+  "Stra\xc3\x9f" "e", "\xe2\x80\x9cquoted\xe2\x80\x9d", "it\xe2\x80\x99s",
+  "caf\xc3\x83\xc2\xa9", "na\xc3\x83\xc2\xafve", "it\xc3\xa2\xe2\x82\xac\xe2\x84\xa2s",
+  "caf\xe9", "na\xefve"
+};
+#define NUTF8_WORDS (sizeof(utf8_words) / sizeof(utf8_words[0]))
+
+static void
+put_words(FILE *f, unsigned n)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (i)
+	fputc(' ', f);
+      fputs(words[rng_below(NWORDS)], f);
+    }
+}
+
+/* Short log lines, one record per line. */
+static unsigned long long
+gen_logs(FILE *f, long long size)
+{
+  unsigned long long records = 0;
+
+  while (ftell(f) < size)
+    {
+      unsigned level = rng_below(sizeof(levels) / sizeof(levels[0]));
+      fprintf(f, "2020-03-%02u %02u:%02u:%02u host%02u app[%u]: %s ",
+	      1 + rng_below(28), rng_below(24), rng_below(60), rng_below(60),
+	      rng_below(32), 1000 + rng_below(9000), levels[level]);
+      put_words(f, 3 + rng_below(10));
+      if (levels[level][0] == 'E')
+	fprintf(f, " timeout conn%u", rng_below(100));
+      fputc('\n', f);
+      records++;
+    }
+  return records;
+}
+
+/* Long multi-line records, each starting with a `Title: ' line.  Use
+   with -d '^Title: '. */
+static unsigned long long
+gen_records(FILE *f, long long size)
+{
+  unsigned long long records = 0;
+
+  while (ftell(f) < size)
+    {
+      unsigned lines, i;
+
+      fputs("Title: ", f);
+      put_words(f, 2 + rng_below(6));
+      fprintf(f, "\nAuthor: author%u\nYear: %u\n",
+	      rng_below(5000), 1970 + rng_below(50));
+      lines = 5 + rng_below(60);
+      for (i = 0; i < lines; i++)
+	{
+	  fputs("    ", f);
+	  put_words(f, 6 + rng_below(10));
+	  fputc('\n', f);
+	}
+      records++;
+    }
+  return records;
+}
+
+/* NUL-separated records, as written by `find -print0'.  Use with
+   -d '\x00'. */
+static unsigned long long
+gen_nul(FILE *f, long long size)
+{
+  unsigned long long records = 0;
+
+  while (ftell(f) < size)
+    {
+      unsigned depth = 1 + rng_below(6), i;
+
+      for (i = 0; i < depth; i++)
+	fprintf(f, "/%s", words[rng_below(NWORDS)]);
+      fprintf(f, "-%u.log", rng_below(1000));
+      fputc('\0', f);
+      records++;
+    }
+  return records;
+}
+
+/* UTF-8 text with some invalid sequences and mojibake. */
+static unsigned long long
+gen_utf8(FILE *f, long long size)
+{
+  unsigned long long records = 0;
+
+  while (ftell(f) < size)
+    {
+      unsigned n = 4 + rng_below(12), i;
+
+      for (i = 0; i < n; i++)
+	{
+	  if (i)
+	    fputc(' ', f);
+	  if (rng_below(4) == 0)
+	    fputs(utf8_words[rng_below(NUTF8_WORDS)], f);
+	  else
+	    fputs(words[rng_below(NWORDS)], f);
+	}
+      fputc('\n', f);
+      records++;
+    }
+  return records;
+}
+
+/* Many small log files in directory `dir'. */
+static unsigned long long
+gen_small_files(const char *dir, long long size)
+{
+  unsigned long long records = 0;
+  long long written = 0;
+  unsigned nfile = 0;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, dir, strerror(errno));
+      exit(2);
+    }
+  while (written < size)
+    {
+      char path[4096];
+      FILE *f;
+
+      snprintf(path, sizeof(path), "%s/f%06u.log", dir, nfile++);
+      f = fopen(path, "w");
+      if (f == NULL)
+	{
+	  fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+	  exit(2);
+	}
+      records += gen_logs(f, 512 + rng_below(4096));
+      written += ftell(f);
+      fclose(f);
+    }
+  return records;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *kind, *output;
+  long long size;
+  unsigned long long records;
+  FILE *f;
+
+  program_name = argv[0];
+  if (argc != 5)
+    {
+      fprintf(stderr, "Usage: %s KIND SEED SIZE OUTPUT\n"
+	      "KIND is one of: logs records nul utf8 small-files\n",
+	      program_name);
+      return 2;
+    }
+  kind = argv[1];
+  rng_seed(strtoull(argv[2], NULL, 10));
+  size = strtoll(argv[3], NULL, 10);
+  output = argv[4];
+
+  if (strcmp(kind, "small-files") == 0)
+    {
+      printf("%llu\n", gen_small_files(output, size));
+      return 0;
+    }
+
+  f = fopen(output, "w");
+  if (f == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, output, strerror(errno));
+      return 2;
+    }
+  if (strcmp(kind, "logs") == 0)
+    records = gen_logs(f, size);
+  else if (strcmp(kind, "records") == 0)
+    records = gen_records(f, size);
+  else if (strcmp(kind, "nul") == 0)
+    records = gen_nul(f, size);
+  else if (strcmp(kind, "utf8") == 0)
+    records = gen_utf8(f, size);
+  else
+    {
+      fprintf(stderr, "%s: unknown corpus kind `%s'\n", program_name, kind);
+      return 2;
+    }
+  if (fclose(f) != 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", program_name, output, strerror(errno));
+      return 2;
+    }
+  printf("%llu\n", records);
+  return 0;
+}
@@ -0,0 +1,1290 @@
+/*
+  libagrep.c - Approximate record search, as a library
+
+  This software is released under a BSD-style license.
+  See the file LICENSE for details and copyright.
+
+  See libagrep.h for the interface.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1		/* memmem() */
+#endif /* _GNU_SOURCE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <langinfo.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#include "libagrep.h"
+
+#undef MIN
+#define MIN(a, b) (((a) <= (b)) ? (a) : (b))
+
+/* Initial size of the record buffer. */
+#define INITIAL_BUF_SIZE 10240
+
+/* Large buffers are grown by remapping their pages, not by copying. */
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+#define HAVE_ARENA 1
+#endif
+
+void
+agrep_options_init(struct agrep_options *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  tre_regaparams_default(&opts->params);
+  opts->params.max_cost = 0;
+}
+
+int
+agrep_is_literal(const char *regexp)
+{
+  return *regexp != '\0' && strpbrk(regexp, "\\.[]()*+?{}|^$") == NULL;
+}
+
+int
+agrep_word_native(void)
+{
+  const char *codeset;
+
+  if (MB_CUR_MAX == 1)
+    return 1;
+  codeset = nl_langinfo(CODESET);
+  return strcmp(codeset, "UTF-8") == 0 || strcmp(codeset, "utf8") == 0;
+}
+
+/* If `literal', the regexp is quoted with the \Q and \E extensions.  If
+   the string already contains occurrences of \E, we need to handle them
+   separately.  This is a pain, but can't really be avoided if we want to
+   create a regexp which works together with `word'. */
+char *
+agrep_pattern_build(const char *regexp, int literal, int word)
+{
+  const char *next_pos;
+  char *new_re, *new_re_end;
+  size_t len = strlen(regexp);
+  int n = 0;
+
+  if (literal)
+    {
+      next_pos = regexp;
+      while ((next_pos = strstr(next_pos, "\\E")) != NULL)
+	{
+	  n++;
+	  next_pos += 2;
+	}
+    }
+
+  new_re = malloc(len + 5 + n * 7 + (word ? 6 : 0));
+  if (new_re == NULL)
+    return NULL;
+  new_re_end = new_re;
+
+  /* With `word', add beginning-of-word and end-of-word assertions. */
+  if (word)
+    {
+      strcpy(new_re_end, "\\<(");
+      new_re_end += 3;
+    }
+
+  if (literal)
+    {
+      strcpy(new_re_end, "\\Q");
+      new_re_end += 2;
+      next_pos = regexp;
+      while (next_pos)
+	{
+	  const char *start = next_pos;
+	  next_pos = strstr(next_pos, "\\E");
+	  if (next_pos)
+	    {
+	      memcpy(new_re_end, start, next_pos - start);
+	      new_re_end += next_pos - start;
+	      strcpy(new_re_end, "\\E\\\\E\\Q");
+	      new_re_end += 7;
+	      next_pos += 2;
+	    }
+	  else
+	    {
+	      strcpy(new_re_end, start);
+	      new_re_end += strlen(start);
+	    }
+	}
+      strcpy(new_re_end, "\\E");
+      new_re_end += 2;
+    }
+  else
+    {
+      strcpy(new_re_end, regexp);
+      new_re_end += len;
+    }
+
+  if (word)
+    strcpy(new_re_end, ")\\>");
+  return new_re;
+}
+
+/* Required factors.  A regexp is read as a sequence of atoms, each
+   with optional bounds.  Runs of literal characters that must all
+   appear, one after the other, are the factors; any other atom ends the
+   current run, and a group that must appear is read the same way. */
+
+#define AGREP_FACTOR_MIN 2	/* Shorter factors are not worth a memmem(). */
+
+struct agrep_factor_list {
+  char *text;		   /* Bytes of the factors. */
+  size_t text_len;
+  size_t run;		   /* Start of the current run in `text'. */
+  size_t *start;	   /* Start and length of each factor. */
+  size_t *len;
+  size_t n;
+  int mb;		   /* 0 single byte, 1 UTF-8, -1 other multibyte. */
+};
+
+/* Returns the largest number of edits the costs and limits of `p'
+   allow in a match. */
+static long long
+agrep_max_edits(const regaparams_t *p)
+{
+  const int costs[3] = { p->cost_ins, p->cost_del, p->cost_subst };
+  const int limits[3] = { p->max_ins, p->max_del, p->max_subst };
+  long long sum = 0;
+  int i, min_cost = INT_MAX;
+
+  for (i = 0; i < 3; i++)
+    {
+      long long n = costs[i] > 0 ? p->max_cost / costs[i] : INT_MAX;
+
+      sum += MIN(n, (long long)limits[i]);
+      min_cost = MIN(min_cost, costs[i]);
+    }
+  if (min_cost > 0)
+    sum = MIN(sum, (long long)(p->max_cost / min_cost));
+  return MIN(sum, (long long)p->max_err);
+}
+
+static void
+agrep_factor_end_run(struct agrep_factor_list *f)
+{
+  if (f->text_len > f->run)
+    {
+      f->start[f->n] = f->run;
+      f->len[f->n] = f->text_len - f->run;
+      f->n++;
+    }
+  f->run = f->text_len;
+}
+
+/* Returns the end of the character at `p', or NULL if it cannot be
+   told. */
+static const char *
+agrep_factor_char(const struct agrep_factor_list *f, const char *p,
+		  const char *end)
+{
+  if ((unsigned char)*p++ < 0x80 || f->mb == 0)
+    return p;
+  if (f->mb < 0)
+    return NULL;
+  while (p < end && ((unsigned char)*p & 0xc0) == 0x80)
+    p++;
+  return p;
+}
+
+/* Returns the end of the bracket expression whose contents start at
+   `p', or NULL if it has none. */
+static const char *
+agrep_skip_bracket(const char *p, const char *end)
+{
+  if (p < end && *p == '^')
+    p++;
+  if (p < end && *p == ']')
+    p++;
+  while (p < end && *p != ']')
+    {
+      if (*p == '[' && p + 1 < end
+	  && (p[1] == ':' || p[1] == '=' || p[1] == '.'))
+	{
+	  char c = p[1];
+
+	  for (p += 2; p + 1 < end && !(p[0] == c && p[1] == ']'); p++)
+	    ;
+	  if (p + 1 >= end)
+	    return NULL;
+	  p += 2;
+	}
+      else
+	p++;
+    }
+  return p < end ? p + 1 : NULL;
+}
+
+/* Returns the `)' that closes the group whose contents start at `p', or
+   NULL if there is none. */
+static const char *
+agrep_skip_group(const char *p, const char *end)
+{
+  int depth = 0;
+
+  while (p < end)
+    {
+      if (*p == '\\')
+	{
+	  p += 2;
+	  continue;
+	}
+      if (*p == '[')
+	{
+	  p = agrep_skip_bracket(p + 1, end);
+	  if (p == NULL)
+	    return NULL;
+	  continue;
+	}
+      if (*p == '(')
+	depth++;
+      else if (*p == ')' && depth-- == 0)
+	return p;
+      p++;
+    }
+  return NULL;
+}
+
+/* Adds the factors of the regexp from `p' to `end' to `f'.  Returns 0, or
+   -1 if the regexp is not understood. */
+static int
+agrep_factors_scan(struct agrep_factor_list *f, const char *p,
+		   const char *end)
+{
+  size_t n0 = f->n, text0 = f->text_len;
+
+  while (p < end)
+    {
+      const char *atom = NULL, *group = NULL, *group_end = NULL;
+      size_t atom_len = 0;
+      int min = 1, bounded = 0, zero;
+
+      switch (*p)
+	{
+	case '|':
+	  /* With alternatives, no one string is needed. */
+	  f->n = n0;
+	  f->text_len = f->run = text0;
+	  return 0;
+	case '(':
+	  if (p + 1 < end && p[1] == '?')
+	    return -1;
+	  group = p + 1;
+	  group_end = agrep_skip_group(group, end);
+	  if (group_end == NULL)
+	    return -1;
+	  p = group_end + 1;
+	  break;
+	case '[':
+	  p = agrep_skip_bracket(p + 1, end);
+	  if (p == NULL)
+	    return -1;
+	  break;
+	case '\\':
+	  if (p + 1 >= end || p[1] == 'Q' || p[1] == 'x'
+	      || (unsigned char)p[1] >= 0x80)
+	    return -1;
+	  if (strchr("\\.[]()*+?{}|^$", p[1]) != NULL)
+	    {
+	      atom = p + 1;
+	      atom_len = 1;
+	    }
+	  p += 2;
+	  break;
+	case ')': case '*': case '+': case '?': case '{':
+	  return -1;
+	case '.': case '^': case '$':
+	  p++;
+	  break;
+	default:
+	  atom = p;
+	  p = agrep_factor_char(f, p, end);
+	  if (p == NULL)
+	    return -1;
+	  atom_len = p - atom;
+	  break;
+	}
+
+      /* Bounds.  Anything but {N}, {N,} and {N,M}, e.g. the approximate
+	 {~...} of TRE, is not understood. */
+      while (p < end && strchr("*+?{", *p) != NULL)
+	{
+	  bounded = 1;
+	  if (*p != '{')
+	    {
+	      if (*p != '+')
+		min = 0;
+	      p++;
+	      continue;
+	    }
+	  if (++p >= end || *p < '0' || *p > '9')
+	    return -1;
+	  for (zero = 1; p < end && *p >= '0' && *p <= '9'; p++)
+	    if (*p != '0')
+	      zero = 0;
+	  if (zero)
+	    min = 0;
+	  if (p < end && *p == ',')
+	    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+	      ;
+	  if (p >= end || *p != '}')
+	    return -1;
+	  p++;
+	}
+
+      if (atom != NULL && min > 0)
+	{
+	  memcpy(f->text + f->text_len, atom, atom_len);
+	  f->text_len += atom_len;
+	}
+      if (atom == NULL || bounded)
+	agrep_factor_end_run(f);
+      if (group != NULL && min > 0
+	  && agrep_factors_scan(f, group, group_end) != 0)
+	return -1;
+    }
+  agrep_factor_end_run(f);
+  return 0;
+}
+
+void
+agrep_searcher_factors(struct agrep_searcher *s, const char *regexp,
+		       int cflags, int literal)
+{
+  struct agrep_factor_list f;
+  size_t len = strlen(regexp), i, j;
+  long long edits = agrep_max_edits(&s->params);
+
+  s->nfactors = 0;
+  if ((cflags & REG_ICASE) || (!literal && !(cflags & REG_EXTENDED))
+      || edits >= AGREP_MAX_FACTORS)
+    return;
+
+  memset(&f, 0, sizeof(f));
+  f.mb = MB_CUR_MAX == 1 ? 0 : agrep_word_native() ? 1 : -1;
+  f.text = malloc(len + 1);
+  f.start = malloc((len + AGREP_MAX_FACTORS + 1) * sizeof(*f.start));
+  f.len = malloc((len + AGREP_MAX_FACTORS + 1) * sizeof(*f.len));
+  if (f.text == NULL || f.start == NULL || f.len == NULL)
+    goto out;		     /* The search just goes without them. */
+
+  if (!literal)
+    {
+      if (agrep_factors_scan(&f, regexp, regexp + len) != 0)
+	f.n = 0;
+    }
+  else
+    {
+      /* Only bytes that are whole characters can be split. */
+      for (i = 0; i < len && (f.mb >= 0 || (unsigned char)regexp[i] < 0x80);
+	   i++)
+	;
+      if (i == len)
+	{
+	  memcpy(f.text, regexp, len);
+	  f.text_len = len;
+	  agrep_factor_end_run(&f);
+	}
+    }
+
+  for (i = j = 0; i < f.n; i++)
+    if (f.len[i] >= AGREP_FACTOR_MIN)
+      {
+	f.start[j] = f.start[i];
+	f.len[j++] = f.len[i];
+      }
+  f.n = j;
+
+  /* An edit breaks at most one factor, so there must be more factors
+     than edits.  Split the longest, between characters, until there
+     are. */
+  while (f.n > 0 && (long long)f.n <= edits)
+    {
+      size_t k = 0, half;
+
+      for (i = 1; i < f.n; i++)
+	if (f.len[i] > f.len[k])
+	  k = i;
+      half = f.len[k] / 2;
+      while (f.mb > 0 && half > 0
+	     && ((unsigned char)f.text[f.start[k] + half] & 0xc0) == 0x80)
+	half--;
+      if (half < AGREP_FACTOR_MIN || f.len[k] - half < AGREP_FACTOR_MIN)
+	{
+	  f.n = 0;
+	  break;
+	}
+      f.start[f.n] = f.start[k] + half;
+      f.len[f.n] = f.len[k] - half;
+      f.len[k] = half;
+      f.n++;
+    }
+
+  /* Keep the longest, which are found the fastest and are the least
+     likely to be in a record by chance, and try them first. */
+  for (i = 0; i < f.n && i < AGREP_MAX_FACTORS; i++)
+    {
+      size_t k = i, n;
+
+      for (j = i + 1; j < f.n; j++)
+	if (f.len[j] > f.len[k])
+	  k = j;
+      n = MIN(f.len[k], (size_t)AGREP_FACTOR_SIZE);
+      memcpy(s->factors[i], f.text + f.start[k], n);
+      s->factor_len[i] = n;
+      f.start[k] = f.start[i];
+      f.len[k] = f.len[i];
+    }
+  s->nfactors = i;
+
+ out:
+  free(f.text);
+  free(f.start);
+  free(f.len);
+}
+
+int
+agrep_searcher_init(struct agrep_searcher *s,
+		    const struct agrep_options *opts,
+		    char *errbuf, size_t errbuf_size)
+{
+  char *regexp;
+  int errcode;
+
+  memset(s, 0, sizeof(*s));
+  s->params = opts->params;
+  s->flags = opts->flags;
+
+  regexp = agrep_pattern_build(opts->pattern, opts->literal, 0);
+  if (regexp == NULL)
+    {
+      snprintf(errbuf, errbuf_size, "%s", strerror(ENOMEM));
+      return REG_ESPACE;
+    }
+  errcode = tre_regcomp(&s->preg, regexp, REG_EXTENDED | opts->cflags);
+  free(regexp);
+  if (errcode != REG_OK)
+    {
+      tre_regerror(errcode, &s->preg, errbuf, errbuf_size);
+      return errcode;
+    }
+
+  if (opts->word)
+    {
+      regexp = agrep_pattern_build(opts->pattern, opts->literal, 1);
+      if (regexp == NULL)
+	{
+	  snprintf(errbuf, errbuf_size, "%s", strerror(ENOMEM));
+	  tre_regfree(&s->preg);
+	  return REG_ESPACE;
+	}
+      errcode = tre_regcomp(&s->word_preg, regexp,
+			    REG_EXTENDED | opts->cflags);
+      free(regexp);
+      if (errcode != REG_OK)
+	{
+	  tre_regerror(errcode, &s->word_preg, errbuf, errbuf_size);
+	  tre_regfree(&s->preg);
+	  return errcode;
+	}
+      s->word = 1;
+      s->word_native = agrep_word_native();
+    }
+
+  errcode = tre_regcomp(&s->delim, opts->delimiter ? opts->delimiter : "\n",
+			REG_EXTENDED | REG_NEWLINE);
+  if (errcode != REG_OK)
+    {
+      tre_regerror(errcode, &s->delim, errbuf, errbuf_size);
+      tre_regfree(&s->preg);
+      if (s->word)
+	tre_regfree(&s->word_preg);
+      return errcode;
+    }
+  if (tre_regexec(&s->delim, "", 0, NULL, 0) == REG_OK)
+    {
+      snprintf(errbuf, errbuf_size, "%s",
+	       "Record delimiter pattern must not match an empty string");
+      tre_regfree(&s->preg);
+      if (s->word)
+	tre_regfree(&s->word_preg);
+      tre_regfree(&s->delim);
+      return REG_BADPAT;
+    }
+
+  s->owns_regex = 1;
+
+  /* Plain strings are found with memmem(). */
+  if (!(opts->cflags & REG_ICASE)
+      && (opts->literal || agrep_is_literal(opts->pattern)))
+    {
+      s->literal = opts->pattern;
+      s->literal_len = strlen(opts->pattern);
+    }
+  agrep_searcher_factors(s, opts->pattern, REG_EXTENDED | opts->cflags,
+			 opts->literal);
+  if (opts->delimiter == NULL || agrep_is_literal(opts->delimiter))
+    {
+      s->delim_literal = opts->delimiter ? opts->delimiter : "\n";
+      s->delim_literal_len = strlen(s->delim_literal);
+    }
+  return 0;
+}
+
+void
+agrep_searcher_destroy(struct agrep_searcher *s)
+{
+  if (s->owns_regex)
+    {
+      tre_regfree(&s->preg);
+      if (s->word)
+	tre_regfree(&s->word_preg);
+      tre_regfree(&s->delim);
+      s->owns_regex = 0;
+    }
+}
+
+/* Returns 1 if byte `c' is a word character for \< and \>, 0 if it is
+   not, and -1 if it is part of a non-ASCII character. */
+static int
+agrep_word_byte(unsigned char c)
+{
+  if (c >= 0x80)
+    return -1;
+  return c == '_' || (c >= '0' && c <= '9')
+    || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+/* Returns 1 if the span `so'..`eo' of the `len' bytes at `rec' is where
+   \<(...)\> could match, 0 if it is not, and -1 if that depends on
+   non-ASCII characters. */
+static int
+agrep_word_span(const char *rec, size_t len, size_t so, size_t eo)
+{
+  int before = so > 0 ? agrep_word_byte(rec[so - 1]) : 0;
+  int first = so < len ? agrep_word_byte(rec[so]) : 0;
+  int last = eo > 0 ? agrep_word_byte(rec[eo - 1]) : 0;
+  int after = eo < len ? agrep_word_byte(rec[eo]) : 0;
+
+  if (before == 1 || first == 0 || last == 0 || after == 1)
+    return 0;
+  if (before < 0 || first < 0 || last < 0 || after < 0)
+    return -1;
+  return 1;
+}
+
+/* Runs `preg' on a record and fills in `m', with the span if `span'.
+   Returns 0, or -1 if out of memory. */
+static int
+agrep_exec(const struct agrep_searcher *s, const regex_t *preg,
+	   const char *rec, size_t len, struct agrep_match *m, int span)
+{
+  regamatch_t match;
+  regmatch_t pmatch[1];
+  int errcode;
+
+  memset(&match, 0, sizeof(match));
+  if (span)
+    {
+      match.pmatch = pmatch;
+      match.nmatch = 1;
+    }
+  errcode = tre_reganexec(preg, rec, len, &match, s->params, 0);
+  if (errcode == REG_ESPACE)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  m->matched = errcode == REG_OK;
+  m->cost = m->matched ? match.cost : 0;
+  if (m->matched && span)
+    {
+      m->so = pmatch[0].rm_so;
+      m->eo = pmatch[0].rm_eo;
+    }
+  else
+    m->so = m->eo = -1;
+  return 0;
+}
+
+const char *
+agrep_searcher_required(const struct agrep_searcher *s, size_t *len)
+{
+  if (s->flags & AGREP_INVERT)
+    return NULL;
+  if (s->literal != NULL && s->params.max_cost == 0)
+    {
+      *len = s->literal_len;
+      return s->literal;
+    }
+  if (s->nfactors > 0 && agrep_max_edits(&s->params) == 0)
+    {
+      *len = s->factor_len[0];
+      return s->factors[0];
+    }
+  return NULL;
+}
+
+/* Returns 1 if the `len' bytes at `rec' have enough of the factors of
+   `s' for a match with the current costs, 0 if they do not. */
+static int
+agrep_factors_found(const struct agrep_searcher *s, const char *rec,
+		    size_t len)
+{
+  long long need = s->nfactors - agrep_max_edits(&s->params);
+  int i;
+
+  for (i = 0; i < s->nfactors && need > 0; i++)
+    {
+      if (memmem(rec, len, s->factors[i], s->factor_len[i]) != NULL)
+	need--;
+      else if (s->nfactors - i - 1 < need)
+	return 0;
+    }
+  return 1;
+}
+
+int
+agrep_searcher_match(const struct agrep_searcher *s, const char *rec,
+		     size_t len, struct agrep_match *m)
+{
+  int span = (s->flags & AGREP_SPAN) != 0;
+
+  /* In a selective search, most records cannot match, and memmem()
+     tells that much faster than the pattern. */
+  if (s->nfactors > 0 && (s->literal == NULL || s->params.max_cost != 0)
+      && !agrep_factors_found(s, rec, len))
+    {
+      m->matched = 0;
+      m->cost = 0;
+      m->so = m->eo = -1;
+      return (s->flags & AGREP_INVERT) != 0;
+    }
+
+  if (s->literal != NULL && s->params.max_cost == 0)
+    {
+      const char *p = rec, *end = rec + len;
+      int word = 1;
+
+      /* With `word', go on to the next occurrence until one is a whole
+	 word, or until only `word_preg' can tell. */
+      while ((p = memmem(p, end - p, s->literal, s->literal_len)) != NULL)
+	{
+	  if (!s->word)
+	    break;
+	  word = s->word_native
+	    ? agrep_word_span(rec, len, p - rec, p - rec + s->literal_len)
+	    : -1;
+	  if (word != 0 || p == end)
+	    break;
+	  p++;
+	}
+      if (p == NULL || word > 0)
+	{
+	  m->matched = p != NULL && word > 0;
+	  m->cost = 0;
+	  if (m->matched && span)
+	    {
+	      m->so = p - rec;
+	      m->eo = m->so + s->literal_len;
+	    }
+	  else
+	    m->so = m->eo = -1;
+	  return m->matched != ((s->flags & AGREP_INVERT) != 0);
+	}
+      if (word == 0)
+	{
+	  m->matched = 0;
+	  m->cost = 0;
+	  m->so = m->eo = -1;
+	  return (s->flags & AGREP_INVERT) != 0;
+	}
+    }
+  else if (s->word)
+    {
+      /* The pattern without \<(...)\> is cheaper to run, and if it does
+	 not match, neither does the whole word.  If it matches exactly,
+	 or the cost does not matter, a word-bounded span is as good as
+	 a match of `word_preg'. */
+      if (agrep_exec(s, &s->preg, rec, len, m, 1) != 0)
+	return -1;
+      if (!m->matched
+	  || (s->word_native
+	      && (s->params.max_cost == 0
+		  || (s->flags & (AGREP_ANY_COST | AGREP_SPAN))
+		     == AGREP_ANY_COST)
+	      && agrep_word_span(rec, len, m->so, m->eo) > 0))
+	{
+	  if (!span)
+	    m->so = m->eo = -1;
+	  return m->matched != ((s->flags & AGREP_INVERT) != 0);
+	}
+    }
+
+  if (agrep_exec(s, s->word ? &s->word_preg : &s->preg, rec, len, m,
+		 span) != 0)
+    return -1;
+  return m->matched != ((s->flags & AGREP_INVERT) != 0);
+}
+
+static unsigned long long
+agrep_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the number of bytes `c' in `len' bytes at `p'. */
+static size_t
+agrep_count_byte(const char *p, size_t len, unsigned char c)
+{
+  size_t n = 0;
+
+#ifdef __SSE2__
+  /* Compare 16 bytes at a time, and subtract the masks, which are -1
+     for each equal byte, from byte counters.  Before they can overflow,
+     the counters are added up with psadbw. */
+  const __m128i v = _mm_set1_epi8((char)c);
+
+  while (len >= 16)
+    {
+      size_t blocks = MIN(len / 16, 255);
+      __m128i acc = _mm_setzero_si128();
+
+      len -= blocks * 16;
+      while (blocks-- > 0)
+	{
+	  acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(
+			       _mm_loadu_si128((const __m128i *)p), v));
+	  p += 16;
+	}
+      acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+      n += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+    }
+#else /* !__SSE2__ */
+  /* Eight bytes at a time: after the xor, the bytes equal to `c' are
+     zero, and `t' gets the high bit of each zero byte, without carries
+     between bytes.  The multiplication adds up the bits. */
+  const uint64_t ones = 0x0101010101010101ULL, low = ones * 0x7f;
+
+  while (len >= 8)
+    {
+      uint64_t w, t;
+
+      memcpy(&w, p, 8);
+      w ^= ones * c;
+      t = ~(((w & low) + low) | w | low);
+      n += ((t >> 7) * ones) >> 56;
+      p += 8;
+      len -= 8;
+    }
+#endif /* !__SSE2__ */
+  while (len-- > 0)
+    n += (unsigned char)*p++ == c;
+  return n;
+}
+
+size_t
+agrep_count_delims(const char *p, size_t len, const char *delim,
+		   size_t delim_len)
+{
+  const char *end = p + len;
+  size_t n = 0;
+
+  if (delim_len == 1)
+    return agrep_count_byte(p, len, delim[0]);
+  while ((p = memmem(p, end - p, delim, delim_len)) != NULL)
+    {
+      n++;
+      p += delim_len;
+    }
+  return n;
+}
+
+/* Finds the first delimiter in `len' bytes at `p', and returns its
+   span in `so' and `eo'.  Returns a REG_* code like tre_regnexec(). */
+static int
+agrep_find_delim(const regex_t *delim, const char *delim_literal,
+		 size_t delim_literal_len, const char *p, size_t len,
+		 size_t *so, size_t *eo)
+{
+  const char *d;
+
+  if (delim_literal == NULL)
+    {
+      regmatch_t pmatch[1];
+      int errcode = tre_regnexec(delim, p, len, 1, pmatch, 0);
+
+      *so = pmatch[0].rm_so;
+      *eo = pmatch[0].rm_eo;
+      return errcode;
+    }
+  if (delim_literal_len == 1)
+    d = memchr(p, delim_literal[0], len);
+  else
+    d = memmem(p, len, delim_literal, delim_literal_len);
+  if (d == NULL)
+    return REG_NOMATCH;
+  *so = d - p;
+  *eo = *so + delim_literal_len;
+  return REG_OK;
+}
+
+int
+agrep_reader_init(struct agrep_reader *rd, const struct agrep_searcher *s)
+{
+  memset(rd, 0, sizeof(*rd));
+  rd->buf = malloc(INITIAL_BUF_SIZE);
+  if (rd->buf == NULL)
+    return -1;
+  rd->buf_size = INITIAL_BUF_SIZE;
+  rd->delim = &s->delim;
+  rd->delim_literal = s->delim_literal;
+  rd->delim_literal_len = s->delim_literal_len;
+  rd->at_eof = 1;
+  return 0;
+}
+
+void
+agrep_reader_destroy(struct agrep_reader *rd)
+{
+#ifdef HAVE_ARENA
+  if (rd->buf_mapped)
+    munmap(rd->buf, rd->buf_size);
+  else
+#endif /* HAVE_ARENA */
+    free(rd->buf);
+  rd->buf = NULL;
+  rd->buf_mapped = 0;
+}
+
+/* Doubles the size of the buffer.  Returns 0, or -1 if out of memory.
+
+   Records of hundreds of megabytes would be copied on every realloc(),
+   and fragment the heap.  From AGREP_ARENA_SIZE on, the buffer is an
+   anonymous mapping instead, which mremap() grows by moving page table
+   entries, and which may use transparent huge pages. */
+static int
+agrep_reader_grow(struct agrep_reader *rd)
+{
+  size_t size;
+  char *new_buf;
+
+  if (rd->buf_size > SIZE_MAX / 2)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  size = rd->buf_size * 2;
+
+#ifdef HAVE_ARENA
+  if (size >= AGREP_ARENA_SIZE)
+    {
+      if (rd->buf_mapped)
+	new_buf = mremap(rd->buf, rd->buf_size, size, MREMAP_MAYMOVE);
+      else
+	{
+	  new_buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  if (new_buf != MAP_FAILED)
+	    {
+	      memcpy(new_buf, rd->buf, rd->data_len);
+	      free(rd->buf);
+	    }
+	}
+      if (new_buf == MAP_FAILED)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+#ifdef MADV_HUGEPAGE
+      madvise(new_buf, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+      rd->buf_mapped = 1;
+    }
+  else
+#endif /* HAVE_ARENA */
+    {
+      new_buf = realloc(rd->buf, size);
+      if (new_buf == NULL)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+    }
+  rd->buf = new_buf;
+  rd->buf_size = size;
+  rd->stats.buf_growths++;
+  return 0;
+}
+
+int
+agrep_reader_fit(struct agrep_reader *rd, int fd)
+{
+  struct stat st;
+  size_t block;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return 0;
+  /* About 16 reads for a file, but no more than AGREP_BLOCK_MAX bytes
+     at a time, which is plenty to amortize a system call. */
+  block = st.st_blksize > 0 ? st.st_blksize : 4096;
+  while (block < AGREP_BLOCK_MAX && (off_t)block * 16 < st.st_size)
+    block *= 2;
+  while (rd->buf_size < block)
+    if (agrep_reader_grow(rd) != 0)
+      return -1;
+  rd->record = rd->buf;
+  return 0;
+}
+
+void
+agrep_reader_start(struct agrep_reader *rd, agrep_read_fn read_fn,
+		   void *read_arg, off_t offset, unsigned long long recnum)
+{
+  rd->read_fn = read_fn;
+  rd->read_arg = read_arg;
+  rd->buf_offset = offset;
+  rd->recnum = recnum;
+  rd->record = rd->buf;
+  rd->record_len = 0;
+  rd->delim_len = 0;
+  rd->next_record = NULL;
+  rd->next_delim_len = 0;
+  rd->data_len = 0;
+  rd->keep_len = 0;
+  rd->at_eof = 0;
+}
+
+int
+agrep_reader_next(struct agrep_reader *rd)
+{
+  if (rd->at_eof)
+    return 0;
+
+  while (1)
+    {
+      int errcode;
+      size_t so, eo;
+      unsigned long long t0 = 0;
+
+      if (rd->next_record == NULL)
+	{
+	  ssize_t r;
+	  size_t read_size = rd->buf_size - rd->data_len;
+
+	  if (read_size == 0)
+	    {
+	      /* The buffer is full and no record delimiter found yet,
+		 we need to grow the buffer.  We double the size to
+		 avoid rescanning the data too many times when the
+		 records are very large. */
+	      if (agrep_reader_grow(rd) != 0)
+		return -1;
+	      read_size = rd->buf_size - rd->data_len;
+	    }
+
+	  r = rd->read_fn(rd->read_arg, rd->buf + rd->data_len, read_size);
+	  if (r < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      return -1;
+	    }
+
+	  if (r == 0)
+	    {
+	      /* End of input.  Return the last record, which has no
+		 delimiter after it. */
+	      rd->record = rd->buf + rd->keep_len;
+	      rd->record_len = rd->data_len - rd->keep_len;
+	      rd->delim_len = rd->next_delim_len;
+	      rd->next_delim_len = 0;
+	      rd->at_eof = 1;
+	      /* The empty string after a trailing delimiter is not considered
+		 to be a record. */
+	      if (rd->record_len == 0)
+		return 0;
+	      rd->recnum++;
+	      return 1;
+	    }
+	  rd->data_len += r;
+	  rd->next_record = rd->buf + rd->keep_len;
+	}
+
+      /* Find the next record delimiter. */
+      if (rd->timing)
+	t0 = agrep_now();
+      errcode = agrep_find_delim(rd->delim, rd->delim_literal,
+				 rd->delim_literal_len, rd->next_record,
+				 rd->data_len - (rd->next_record - rd->buf),
+				 &so, &eo);
+      if (rd->timing)
+	rd->stats.delim_ns += agrep_now() - t0;
+      rd->stats.delim_calls++;
+
+      switch (errcode)
+	{
+	case REG_OK:
+	  /* Record delimiter found, now we know how long the current
+	     record is. */
+	  rd->record = rd->next_record;
+	  rd->record_len = so;
+	  rd->delim_len = rd->next_delim_len;
+	  rd->next_delim_len = eo - so;
+	  rd->next_record += eo;
+	  rd->recnum++;
+	  return 1;
+
+	case REG_NOMATCH:
+	  if (rd->next_record == rd->buf + rd->keep_len)
+	    {
+	      rd->next_record = NULL;
+	      continue;
+	    }
+
+	  /* Move the data to start of the buffer and read more data.
+	     The delimiter before the partial record is kept with it, so
+	     that it is there to be output however the input was split
+	     into reads. */
+	  {
+	    char *start = rd->next_record - rd->next_delim_len;
+
+	    if (start < rd->buf)
+	      start = rd->buf;
+	    rd->keep_len = rd->next_record - start;
+	    rd->stats.bytes_moved += rd->buf + rd->data_len - start;
+	    rd->buf_offset += start - rd->buf;
+	    memmove(rd->buf, start, rd->buf + rd->data_len - start);
+	    rd->data_len = rd->buf + rd->data_len - start;
+	    rd->next_record = NULL;
+	  }
+	  continue;
+
+	default:
+	  errno = ENOMEM;
+	  return -1;
+	}
+    }
+}
+
+int
+agrep_reader_block(struct agrep_reader *rd, char **block, size_t *len)
+{
+  if (rd->at_eof)
+    return 0;
+
+  while (1)
+    {
+      char *last;
+      size_t avail;
+
+      if (rd->next_record == NULL)
+	{
+	  ssize_t r;
+
+	  if (rd->data_len == rd->buf_size && agrep_reader_grow(rd) != 0)
+	    return -1;
+	  r = rd->read_fn(rd->read_arg, rd->buf + rd->data_len,
+			  rd->buf_size - rd->data_len);
+	  if (r < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      return -1;
+	    }
+	  if (r == 0)
+	    {
+	      /* End of input.  The last record has no delimiter. */
+	      rd->record = rd->buf;
+	      rd->record_len = rd->data_len;
+	      rd->recnum += rd->data_len > 0;
+	      rd->at_eof = 1;
+	      *block = rd->buf;
+	      *len = rd->data_len;
+	      return rd->data_len > 0;
+	    }
+	  rd->data_len += r;
+	  rd->next_record = rd->buf;
+	}
+
+      /* The block ends at the last delimiter in the buffer. */
+      avail = rd->data_len - (rd->next_record - rd->buf);
+      rd->stats.delim_calls++;
+      last = memrchr(rd->next_record, rd->delim_literal[0], avail);
+      if (last != NULL)
+	{
+	  *block = rd->next_record;
+	  *len = last + 1 - rd->next_record;
+	  rd->record = *block;
+	  rd->record_len = *len;
+	  rd->recnum += agrep_count_byte(*block, *len, rd->delim_literal[0]);
+	  rd->next_record = last + 1;
+	  return 1;
+	}
+
+      /* Move the partial record to the start of the buffer and read
+	 more data, as agrep_reader_next() does. */
+      if (rd->next_record != rd->buf)
+	{
+	  rd->stats.bytes_moved += avail;
+	  rd->buf_offset += rd->next_record - rd->buf;
+	  memmove(rd->buf, rd->next_record, avail);
+	  rd->data_len = avail;
+	}
+      rd->next_record = NULL;
+    }
+}
+
+/* Searches the records of `rd', which is destroyed afterwards. */
+static long long
+agrep_search_reader(struct agrep_searcher *s, struct agrep_reader *rd,
+		    agrep_record_fn fn, void *arg)
+{
+  struct agrep_match m;
+  long long count = 0;
+  int r;
+
+  while ((r = agrep_reader_next(rd)) > 0)
+    {
+      int selected = agrep_searcher_match(s, rd->record, rd->record_len, &m);
+      if (selected < 0)
+	{
+	  r = -1;
+	  break;
+	}
+      if (!selected)
+	continue;
+      count++;
+      m.record = rd->record;
+      m.record_len = rd->record_len;
+      m.offset = agrep_reader_offset(rd);
+      m.recnum = rd->recnum;
+      if (fn != NULL && fn(&m, arg) != 0)
+	break;
+    }
+  agrep_reader_destroy(rd);
+  return r < 0 ? -1 : count;
+}
+
+long long
+agrep_search_read(struct agrep_searcher *s, agrep_read_fn read_fn,
+		  void *read_arg, agrep_record_fn fn, void *arg)
+{
+  struct agrep_reader rd;
+
+  if (agrep_reader_init(&rd, s) != 0)
+    return -1;
+  agrep_reader_start(&rd, read_fn, read_arg, 0, 0);
+  return agrep_search_reader(s, &rd, fn, arg);
+}
+
+static ssize_t
+agrep_read_fd(void *arg, char *buf, size_t len)
+{
+  return read(*(int *)arg, buf, len);
+}
+
+long long
+agrep_search_fd(struct agrep_searcher *s, int fd, agrep_record_fn fn,
+		void *arg)
+{
+  struct agrep_reader rd;
+
+  if (agrep_reader_init(&rd, s) != 0)
+    return -1;
+  agrep_reader_start(&rd, agrep_read_fd, &fd, 0, 0);
+  if (agrep_reader_fit(&rd, fd) != 0)
+    {
+      agrep_reader_destroy(&rd);
+      return -1;
+    }
+  return agrep_search_reader(s, &rd, fn, arg);
+}
+
+/* Searches a complete input in memory, without copying it.  Records are
+   split the same way as by agrep_reader_next(). */
+long long
+agrep_search_buffer(struct agrep_searcher *s, const char *data, size_t len,
+		    agrep_record_fn fn, void *arg)
+{
+  struct agrep_match m;
+  const char *p = data, *end = data + len;
+  unsigned long long recnum = 0;
+  long long count = 0;
+
+  while (p < end)
+    {
+      size_t rec_len, skip;
+      int errcode, selected;
+
+      errcode = agrep_find_delim(&s->delim, s->delim_literal,
+				 s->delim_literal_len, p, end - p,
+				 &rec_len, &skip);
+      if (errcode == REG_NOMATCH)
+	rec_len = skip = end - p;
+      else if (errcode != REG_OK)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+
+      recnum++;
+      selected = agrep_searcher_match(s, p, rec_len, &m);
+      if (selected < 0)
+	return -1;
+      if (selected)
+	{
+	  count++;
+	  m.record = p;
+	  m.record_len = rec_len;
+	  m.offset = p - data;
+	  m.recnum = recnum;
+	  if (fn != NULL && fn(&m, arg) != 0)
+	    break;
+	}
+      p += skip;
+    }
+  return count;
+}
+
+unsigned long long
+agrep_reader_skip(struct agrep_reader *rd, const char *str, size_t len)
+{
+  char *p = rd->next_record, *end, *q, *last;
+  unsigned long long n;
+
+  if (rd->at_eof || p == NULL || rd->delim_literal_len != 1)
+    return 0;
+  end = rd->buf + rd->data_len;
+  q = memmem(p, end - p, str, len);
+
+  /* Skip up to the start of the record `q' is in, or, if `str' is not
+     in the buffer, all of its complete records. */
+  last = memrchr(p, rd->delim_literal[0], (q != NULL ? q : end) - p);
+  if (last == NULL)
+    return 0;
+  n = agrep_count_byte(p, last + 1 - p, rd->delim_literal[0]);
+  rd->recnum += n;
+  rd->next_record = last + 1;
+  rd->next_delim_len = 1;
+  return n;
+}
@@ -0,0 +1,253 @@
+/*
+  libagrep.h - Approximate record search, as a library
+
+  This software is released under a BSD-style license.
+  See the file LICENSE for details and copyright.
+
+  This is the search engine of agrep without the command line: it
+  splits input into records with a delimiter regexp and matches each
+  record approximately against a pattern.  It keeps no global state,
+  so any number of searchers can be used at the same time, e.g. one per
+  thread, and it never writes to stdout or stderr.
+
+  A simple search:
+
+    struct agrep_options opts;
+    struct agrep_searcher s;
+    char err[256];
+
+    agrep_options_init(&opts);
+    opts.pattern = "hello";
+    opts.params.max_cost = 1;
+    if (agrep_searcher_init(&s, &opts, err, sizeof(err)) != 0)
+      ... report `err' ...
+    agrep_search_fd(&s, fd, callback, arg);
+    agrep_searcher_destroy(&s);
+
+  The callback is called for each selected record and gets its bytes,
+  number, offset, cost and the span of the match within it.
+*/
+
+#ifndef LIBAGREP_H
+#define LIBAGREP_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "regex.h"
+
+/* agrep_options.flags and agrep_searcher.flags. */
+#define AGREP_INVERT	1	/* Select the records that do not match. */
+#define AGREP_SPAN	2	/* Report the span of the match. */
+#define AGREP_ANY_COST	4	/* Any cost within the limits will do, it
+				   need not be the one of the best match. */
+
+struct agrep_options {
+  const char *pattern;	   /* Regexp (POSIX ERE with TRE extensions). */
+  const char *delimiter;   /* Record delimiter regexp, NULL for "\n". */
+  int cflags;		   /* Extra tre_regcomp() flags, e.g. REG_ICASE. */
+  int literal;		   /* The pattern is a literal string (-k). */
+  int word;		   /* Match only whole words (-w). */
+  regaparams_t params;	   /* Costs and limits of approximate matching. */
+  int flags;		   /* AGREP_* flags. */
+};
+
+/* A selected record. */
+struct agrep_match {
+  const char *record;	   /* The record, without delimiters. */
+  size_t record_len;
+  off_t offset;		   /* Offset of the record in the input. */
+  unsigned long long recnum; /* Number of the record, from 1. */
+  int matched;		   /* The pattern matched (see AGREP_INVERT). */
+  int cost;		   /* Cost of the match, if `matched'. */
+  ssize_t so, eo;	   /* Span of the match with AGREP_SPAN, else -1. */
+};
+
+/* Called for each selected record.  Returning nonzero stops the search. */
+typedef int (*agrep_record_fn)(const struct agrep_match *match, void *arg);
+
+/* Reads up to `len' bytes into `buf', like read(2). */
+typedef ssize_t (*agrep_read_fn)(void *arg, char *buf, size_t len);
+
+/* Limits of the factors kept by a searcher (see agrep_searcher_factors()). */
+#define AGREP_MAX_FACTORS 8
+#define AGREP_FACTOR_SIZE 32
+
+/* A searcher.  If `literal' is set, the pattern is that string and, as
+   long as `params.max_cost' is 0, it is found with memmem() instead of
+   `preg'; likewise records are split at `delim_literal' if it is set,
+   and `delim' is not used.  agrep_searcher_init() sets these for plain
+   strings, and still compiles `preg' in case the costs change.
+
+   With `word', `preg' is the pattern as it is and `word_preg' the pattern
+   in \<(...)\>.  A record is first searched with `preg' (or `literal'),
+   and the span found is checked for word boundaries; `word_preg' is run
+   only if that does not decide it.  `word_native' says whether the
+   boundaries can be checked byte by byte (see agrep_word_native()).
+
+   `factors' are strings that every match contains, all but as many as
+   the costs allow edits; a record without enough of them is rejected
+   before the pattern is run. */
+struct agrep_searcher {
+  regex_t preg;		   /* Compiled pattern. */
+  regex_t word_preg;	   /* Compiled pattern for whole words. */
+  int word;		   /* Match only whole words. */
+  int word_native;	   /* Check word boundaries without `word_preg'. */
+  regex_t delim;	   /* Compiled record delimiter. */
+  regaparams_t params;	   /* May be changed between records. */
+  int flags;		   /* AGREP_* flags, may be changed too. */
+  int owns_regex;	   /* agrep_searcher_destroy() frees the regexps. */
+  const char *literal;	   /* The pattern, if it is a plain string. */
+  size_t literal_len;
+  const char *delim_literal; /* The delimiter, if it is a plain string. */
+  size_t delim_literal_len;
+  int nfactors;		   /* Number of `factors', 0 for none. */
+  unsigned char factor_len[AGREP_MAX_FACTORS];
+  char factors[AGREP_MAX_FACTORS][AGREP_FACTOR_SIZE];
+};
+
+/* Counters kept by a reader. */
+struct agrep_reader_stats {
+  unsigned long long buf_growths;    /* Number of times `buf' was grown. */
+  unsigned long long bytes_moved;    /* Bytes shifted by memmove(). */
+  unsigned long long delim_calls;    /* Delimiter searches. */
+  unsigned long long delim_ns;	     /* Time spent in them, with `timing'. */
+};
+
+/* Splits the input returned by a read function into records.  The
+   fields before `buf' describe the current record; the rest is the
+   state of the buffer, which users may look at but not change.  The
+   buffer grows to hold the longest record; past AGREP_ARENA_SIZE it is
+   an anonymous mapping, grown with mremap() where there is one. */
+struct agrep_reader {
+  char *record;		   /* Start of current record. */
+  size_t record_len;	   /* Length of current record. */
+  size_t delim_len;	   /* Length of delimiter before record. */
+  size_t next_delim_len;   /* Length of delimiter after record. */
+  unsigned long long recnum; /* Number of the current record. */
+  int timing;		   /* Measure time spent in delimiter searches. */
+  struct agrep_reader_stats stats;
+
+  char *buf;		   /* Buffer for scanning text. */
+  size_t buf_size;	   /* Current size of the buffer. */
+  size_t data_len;	   /* Amount of data in the buffer. */
+  char *next_record;	   /* Start of next record. */
+  size_t keep_len;	   /* Bytes of delimiter kept before the data. */
+  int at_eof;
+  int buf_mapped;	   /* `buf' is mmap()ed, not malloc()ed. */
+  off_t buf_offset;	   /* Input offset of the start of `buf'. */
+  const regex_t *delim;
+  const char *delim_literal;
+  size_t delim_literal_len;
+  agrep_read_fn read_fn;
+  void *read_arg;
+};
+
+/* Size from which the record buffer is an mmap()ed arena. */
+#define AGREP_ARENA_SIZE (64 * 1024 * 1024)
+
+/* Largest buffer agrep_reader_fit() asks for. */
+#define AGREP_BLOCK_MAX (4 * 1024 * 1024)
+
+/* Offset of the current record in the input. */
+#define agrep_reader_offset(rd) \
+  ((rd)->buf_offset + ((rd)->record - (rd)->buf))
+
+/* Sets `opts' to the defaults: no pattern, newline delimited records,
+   default costs and exact matching. */
+void agrep_options_init(struct agrep_options *opts);
+
+/* Returns 1 if `regexp' has no regexp operators, so it matches just
+   itself. */
+int agrep_is_literal(const char *regexp);
+
+/* Returns 1 if, in the current locale, a byte below 0x80 is always an
+   ASCII character, so that word boundaries next to one can be checked
+   without decoding the text. */
+int agrep_word_native(void);
+
+/* Returns `regexp' rewritten as a malloc()ed regexp that matches it
+   literally (`literal') and/or only as a whole word (`word'), or NULL if
+   out of memory. */
+char *agrep_pattern_build(const char *regexp, int literal, int word);
+
+/* Compiles the pattern and the delimiter of `opts' into `s'.  Returns 0,
+   or a REG_* error code after writing a message to `errbuf'.  The
+   pattern and delimiter strings must stay valid as long as `s' is used. */
+int agrep_searcher_init(struct agrep_searcher *s,
+			const struct agrep_options *opts,
+			char *errbuf, size_t errbuf_size);
+
+void agrep_searcher_destroy(struct agrep_searcher *s);
+
+/* Sets the `factors' of `s' for `regexp', compiled with `cflags' (and
+   quoted first if `literal').  Long strings are split so that there are
+   more of them than the current costs of `s' allow edits.  Patterns
+   with alternatives at the top, REG_ICASE, or syntax that is not
+   understood, such as approximate {~...} bounds, get no factors.
+   agrep_searcher_init() calls this. */
+void agrep_searcher_factors(struct agrep_searcher *s, const char *regexp,
+			    int cflags, int literal);
+
+/* Matches one record.  Fills in the `matched', `cost', `so' and `eo'
+   fields of `m', and returns 1 if the record is selected, 0 if not and
+   -1 if out of memory. */
+int agrep_searcher_match(const struct agrep_searcher *s, const char *rec,
+			 size_t len, struct agrep_match *m);
+
+/* Returns a string that every record selected by `s' contains, with the
+   current costs, and its length in `*len', or NULL if there is none. */
+const char *agrep_searcher_required(const struct agrep_searcher *s,
+				    size_t *len);
+
+/* Returns the number of delimiters `delim' in the `len' bytes at `p', as
+   a reader would find them: from left to right, without overlaps. */
+size_t agrep_count_delims(const char *p, size_t len, const char *delim,
+			  size_t delim_len);
+
+/* Search all records of an input, calling `fn' for each selected one.
+   Return the number of selected records, or -1 with errno set. */
+long long agrep_search_read(struct agrep_searcher *s, agrep_read_fn read_fn,
+			    void *read_arg, agrep_record_fn fn, void *arg);
+long long agrep_search_fd(struct agrep_searcher *s, int fd,
+			  agrep_record_fn fn, void *arg);
+long long agrep_search_buffer(struct agrep_searcher *s, const char *data,
+			      size_t len, agrep_record_fn fn, void *arg);
+
+/* Record readers, used by the functions above.  A reader splits records
+   with the delimiter of searcher `s'. */
+int agrep_reader_init(struct agrep_reader *rd, const struct agrep_searcher *s);
+void agrep_reader_destroy(struct agrep_reader *rd);
+
+/* Starts reading new input with `read_fn', positioned at `offset' and
+   after record number `recnum'. */
+void agrep_reader_start(struct agrep_reader *rd, agrep_read_fn read_fn,
+			void *read_arg, off_t offset,
+			unsigned long long recnum);
+
+/* Grows the buffer to read file `fd' in blocks that suit its size and
+   st_blksize.  Call it after agrep_reader_start(), before reading.
+   Returns 0, or -1 if out of memory. */
+int agrep_reader_fit(struct agrep_reader *rd, int fd);
+
+/* Moves to the next record.  Returns 1 if there is one, 0 at the end of
+   the input and -1 with errno set on read errors and out of memory. */
+int agrep_reader_next(struct agrep_reader *rd);
+
+/* Moves past all the complete records in the buffer, reading more input
+   first if there are none, and returns them in `*block' and `*len' with
+   their delimiters; at the end of the input, the block is the last
+   record, which has none.  Returns 1, 0 at the end of the input and -1
+   with errno set on errors.  This only works with a single byte
+   `delim_literal'.  `recnum' is the number of the last record in the
+   block.  A file is read either by blocks or by records, not both. */
+int agrep_reader_block(struct agrep_reader *rd, char **block, size_t *len);
+
+/* Moves past the complete records in the buffer before the first one
+   that contains `str', or past all of them if none does, so that the
+   next agrep_reader_next() returns that record.  The records skipped
+   are counted in `recnum'.  Returns their number.  This only works with
+   a single byte `delim_literal', which `str' must not contain. */
+unsigned long long agrep_reader_skip(struct agrep_reader *rd,
+				     const char *str, size_t len);
+
+#endif /* LIBAGREP_H */